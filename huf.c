@@ -0,0 +1,5043 @@
+/*
+ * huf.c
+ *
+ * Huffman block codec and container format (libhuf)
+ *
+ * - Count byte frequencies of each block, derive length-limited code
+ *   lengths and canonical codes
+ * - Compress into independent blocks, each with its own code-length table,
+ *   canonical-code bitstream (or stored bytes) and CRC32C
+ * - Decompress block by block through a lookup table built from the code lengths
+ * - Buffer-to-buffer calls through a reusable context, plus streaming,
+ *   multi-threaded file-to-file wrappers
+ *
+ * The public interface is in huf.h; everything else here is static.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* O_DIRECT */
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L /* mmap, posix_madvise, fstat, posix_memalign */
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t for fstat, pread and ftruncate on 32-bit systems */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#define HAVE_MMAP 1
+#endif
+
+/* io_uring through the raw system calls; no liburing needed */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#include "huf.h"
+
+/* -----------------------------
+   Data structures & typedefs
+   ----------------------------- */
+
+/*
+ * A tree over at most 256 leaves has at most 511 nodes, so the whole tree
+ * lives in one flat array and children are linked by index. Building it
+ * never touches the heap.
+ */
+#define HUF_MAX_NODES 512
+
+typedef struct {
+    uint64_t freq;            /* frequency / weight */
+    int16_t left, right;      /* child indices, -1 in leaves */
+    unsigned char ch;         /* character stored (valid in leaves) */
+} HuffmanNode;
+
+typedef struct {
+    HuffmanNode nodes[HUF_MAX_NODES];
+    int count;
+    int root;                 /* -1 for an empty tree */
+} HuffmanTree;
+
+/* Min-heap of node indices into a HuffmanTree */
+typedef struct {
+    const HuffmanNode *nodes;
+    int16_t data[HUF_MAX_NODES];
+    int size;
+} MinHeap;
+
+/* Each code stored as its bit pattern (right-aligned, sent MSB-first) and length */
+typedef struct {
+    uint32_t code;
+    uint8_t len; /* 0 = byte does not occur */
+} Code;
+
+/* One file in an archive: where it is read from and the name it is stored under */
+#define ARCHIVE_SKIPPED UINT64_MAX
+
+typedef struct {
+    char *path;
+    const char *name;          /* path without leading "/", "./" and "../" */
+    uint64_t size;             /* bytes archived, ARCHIVE_SKIPPED if unreadable */
+    uint64_t offset;           /* of its first byte in the uncompressed stream */
+} ArchiveMember;
+
+/*
+ * Input handed out one block at a time: straight from a read-only mapping
+ * when the file can be mapped, otherwise through fread into a caller buffer,
+ * or through read() on an O_DIRECT descriptor into an aligned one. An
+ * archive reads its member files back to back, packing small files
+ * together into each block.
+ */
+typedef struct {
+    const unsigned char *data; /* mapping, or NULL when streaming */
+    uint64_t size;             /* mapped size */
+    uint64_t pos;              /* next unread offset in the mapping */
+    FILE *fp;                  /* streaming fallback, or the member being read */
+    int fd;                    /* direct reads, -1 otherwise */
+    int read_error;            /* a direct read failed */
+    ArchiveMember *members;    /* archive input, NULL otherwise */
+    size_t nmembers, next_member;
+} InputView;
+
+/* Thread pool task and per-worker deque */
+typedef void (*TaskFn)(void *arg);
+
+typedef struct {
+    TaskFn fn;
+    void *arg;
+} Task;
+
+typedef struct {
+    pthread_mutex_t mu;
+    Task *ring;         /* mask + 1 entries */
+    size_t mask;
+    size_t head, tail;  /* head = oldest task, tail = next free slot */
+} TaskDeque;
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+    ThreadPool *pool;
+    int index;
+} WorkerArg;
+
+struct ThreadPool {
+    int nthreads;
+    pthread_t *threads;
+    WorkerArg *args;
+    TaskDeque *deques;
+    size_t next_deque;   /* round-robin target for pool_submit */
+    pthread_mutex_t mu;  /* guards pending and stop */
+    pthread_cond_t cv;
+    size_t pending;      /* queued tasks not yet claimed by a worker */
+    int stop;
+};
+
+/* What the file header says about the rest of the stream */
+typedef struct {
+    int version;
+    uint32_t features;   /* FEATURE_* */
+    uint32_t block_size;
+    size_t header_size;  /* bytes before the first block */
+    size_t end_size;     /* bytes of the end block */
+} FrameInfo;
+
+/* A parsed block header */
+typedef struct {
+    int type;            /* BLOCK_*, without BLOCK_FULL */
+    uint32_t raw_size;
+    uint32_t payload_size;
+    uint32_t crc;
+} BlockHeader;
+
+/* Block index entry: where a block starts in the file and in the output */
+typedef struct {
+    uint64_t offset;     /* file offset of the block header */
+    uint64_t raw_offset; /* offset of its bytes in the decompressed output */
+    uint32_t raw_size;
+} BlockIndexEntry;
+
+/* A block stream file opened through its index, for parallel or random-access decoding */
+typedef struct {
+    int fd;
+    uint64_t file_size;
+    FrameInfo frame;
+    uint64_t stream_size;     /* bytes of block stream; an archive's directory follows */
+    BlockIndexEntry *entries; /* count + 1: the last one marks the end block */
+    uint64_t count;
+    uint64_t total;           /* uncompressed bytes */
+    uint32_t crc;             /* of all of them, if frame has FEATURE_STREAM_CRC */
+    size_t heap;              /* most bytes of heap reading the index took */
+} IndexedFile;
+
+/*
+ * One block in flight through the parallel compressor. Input is either a
+ * slice of the mapping or a copy in inbuf; the job is finished once
+ * done is set under sync->mu.
+ */
+typedef struct {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} JobSync;
+
+/*
+ * Directory walk for an archive: walker threads take directories off a
+ * shared stack, read them, and push back the subdirectories they find.
+ * The walk is over when the stack is empty and no walker is busy.
+ */
+typedef struct {
+    JobSync sync;
+    char **dirs;
+    size_t ndirs, dirs_cap;
+    int busy;                    /* walkers reading a directory */
+    ArchiveMember *files;
+    size_t nfiles, files_cap;
+} DirWalk;
+
+typedef struct HufDict HufDict;
+
+/*
+ * An order-1 coding of a block: the bytes that follow each previous-byte
+ * value are counted separately, those 256 contexts are clustered, and
+ * each cluster gets its own table.
+ */
+typedef struct {
+    int tables;                  /* clusters, 0 if not planned */
+    unsigned char map[256];      /* cluster of each previous byte */
+    unsigned char lengths[HUF_MAX_CONTEXT_TABLES][256];
+    uint64_t bits;               /* payload bits */
+    size_t size;                 /* payload bytes */
+    double entropy;              /* entropy in bits of each byte given the one before it */
+} ContextPlan;
+
+/* What the encoder learns about a block before choosing how to code it */
+typedef struct {
+    uint64_t freq[256];
+    unsigned char lengths[256];  /* the block's own table, if built */
+    int built;                   /* 0 when RLE, stored or a trained table will do */
+    int unique;                  /* distinct bytes */
+    size_t table_size;           /* packed size of lengths */
+    uint64_t bits;               /* payload bits with lengths */
+    double entropy;              /* Shannon entropy in bits, 0 for a single run */
+    ContextPlan context;
+} BlockPlan;
+
+/* The table a repeat block may reuse: the last one sent in the stream */
+typedef struct {
+    int valid;
+    uint64_t block;              /* number of the block that carries it */
+    unsigned char lengths[256];
+} PrevTable;
+
+/* How one block is to be coded */
+typedef struct {
+    int type;                    /* BLOCK_* */
+    uint32_t back;               /* repeat blocks: how many blocks back the table is */
+    unsigned char lengths[256];  /* repeat blocks: the reused table */
+} BlockChoice;
+
+/*
+ * A block goes through the pool twice: once to count and plan it, then,
+ * after the writer has chosen its coding in stream order, to encode it.
+ * Reading it in and writing it out run beside the pool (AsyncIo).
+ */
+enum {
+    JOB_READING, JOB_READ, JOB_QUEUED, JOB_PLANNED, JOB_ENCODED, JOB_WRITING, JOB_WRITTEN
+};
+
+typedef struct {
+    const unsigned char *src;
+    size_t n;
+    unsigned char *inbuf;  /* block copy for streamed input */
+    unsigned char *out;    /* block_bound(block_size) bytes */
+    size_t out_size;
+    const HufOptions *opt;
+    const HufDict *dict;   /* trained table, or NULL */
+    uint32_t *pairs;       /* order-1 counts (256 x 256), NULL unless opt->context_tables */
+    BlockPlan plan;
+    BlockChoice choice;
+    HufStats stats;        /* the pool's work on this block */
+    JobSync *sync;
+    int stage;             /* JOB_*, set under sync->mu */
+    /* the read or write in flight (io_uring) */
+    uint64_t io_off;       /* file offset of its first byte */
+    size_t io_len;         /* bytes asked for */
+    size_t io_need;        /* bytes that must arrive (reads may ask for more, up to alignment) */
+    size_t io_done;        /* bytes transferred so far */
+    int io_ok;             /* 0 once it failed */
+    int io_retried;        /* read retried after dropping O_DIRECT */
+} BlockJob;
+
+/* FIFO of jobs waiting for an I/O thread, guarded by sync->mu */
+typedef struct {
+    BlockJob **ring;
+    size_t cap, head, tail;
+} JobQueue;
+
+/*
+ * Reads of streamed input and writes of finished blocks, run beside the
+ * block coder so the disk and the CPUs are busy at once. io_uring is used
+ * when the kernel has it and both ends are regular files (or the input is
+ * mapped); otherwise one reader and one writer thread do plain blocking
+ * I/O. Either way a job reaches JOB_READ or JOB_WRITTEN under sync->mu.
+ */
+typedef struct {
+    JobSync *sync;
+    InputView *in;
+    FILE *out;
+    size_t block_size;
+    size_t pending;        /* operations not yet complete */
+    int uring;
+    /* I/O threads */
+    JobQueue reads, writes;
+    pthread_t reader, writer;
+    int have_reader, have_writer;
+    int stop;
+#ifdef HAVE_IO_URING
+    int ring_fd, in_fd, out_fd;
+    uint64_t in_size, read_pos, write_pos;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    pthread_mutex_t sq_mu; /* the submission ring */
+    pthread_t reaper;
+#endif
+} AsyncIo;
+
+
+/* Bit writer (MSB-first) that gathers codes in a 64-bit register */
+typedef struct {
+    unsigned char *buf; /* caller's output buffer, needs 8 bytes of slack */
+    size_t pos;         /* completed bytes in buf */
+    uint64_t acc;       /* pending bits, left-aligned (bit 63 is first) */
+    int bit_count;      /* number of pending bits in acc */
+} BitWriter;
+
+/* Bit reader (MSB-first) that keeps up to 64 upcoming bits in a register */
+typedef struct {
+    FILE *fp;                 /* refill source, or NULL for an in-memory block */
+    const unsigned char *buf; /* bytes being consumed */
+    unsigned char *fbuf;      /* fread buffer of FILE-backed readers (the caller's) */
+    size_t fcap;              /* its size */
+    size_t pos, len;          /* read position / valid bytes in buf */
+    uint64_t acc;             /* upcoming bits, left-aligned (bit 63 is next) */
+    int bit_count;            /* number of valid bits in acc (0..64) */
+} BitReader;
+
+/*
+ * Decode lookup table: indexed by the next HUF_TABLE_BITS bits of input.
+ * Each entry is (code length << 8) | symbol. Length 0 marks a prefix of a
+ * code longer than HUF_TABLE_BITS, which is resolved by walking the tree.
+ */
+#define HUF_TABLE_BITS 11
+
+typedef struct {
+    uint16_t entry[1 << HUF_TABLE_BITS];
+    /* slow path for long codes: legacy files walk the tree, canonical ones
+       use the first code and symbol offset of each length */
+    const HuffmanTree *tree;
+    uint64_t first[HUF_MAX_CODE_LEN + 2];
+    int count[HUF_MAX_CODE_LEN + 1];
+    int offset[HUF_MAX_CODE_LEN + 1];
+    unsigned char symbols[256]; /* bytes sorted by (length, value) */
+    int max_len;
+    int complete; /* 0 for a one-symbol code, whose other half of the table decodes nothing */
+} DecodeTable;
+
+/*
+ * The hot bit-packing loops, compiled once per instruction set and picked
+ * for the running CPU on first use (see "Bit kernels" below). Every set of
+ * kernels reads and writes exactly the same bits.
+ */
+typedef struct {
+    const char *name;
+    void (*encode)(BitWriter *bw, const Code codes[256], int max_len, const unsigned char *src, size_t n);
+    void (*encode_context)(BitWriter *bw, const Code *const by_prev[256], int max_len,
+                           const unsigned char *src, size_t n, unsigned prev);
+    size_t (*decode)(const DecodeTable *table, BitReader *br, unsigned char *dst, size_t count);
+    int (*decode4)(const DecodeTable *t, BitReader br[4], unsigned char *dst, size_t n);
+    size_t (*decode_context)(const DecodeTable *tables, const unsigned char map[256], int max_len,
+                             BitReader *br, unsigned char *dst, size_t count);
+} BitKernels;
+
+/* A trained table loaded into a context, with its encode and decode tables ready */
+struct HufDict {
+    uint32_t id;
+    unsigned char lengths[256]; /* every byte has a code */
+    Code codes[256];
+    int max_len;
+    DecodeTable table;
+};
+
+/*
+ * Decoder state carried from block to block, so a repeat block finds the
+ * table it reuses already built.
+ */
+typedef struct {
+    DecodeTable *table;
+    DecodeTable *context; /* HUF_MAX_CONTEXT_TABLES tables for order-1 blocks */
+    uint64_t table_block; /* block whose lengths are in table, UINT64_MAX if none */
+    uint64_t block;       /* number of the block being decoded */
+    const HufDict *dict;
+    HufStats *stats;
+} BlockDecoder;
+
+/* One block in flight through the parallel decompressor */
+typedef struct {
+    int in_fd, out_fd;    /* out_fd < 0: verify only */
+    const FrameInfo *frame;
+    const BlockIndexEntry *entries;
+    uint64_t block;       /* number of the block in entries */
+    uint64_t cap;         /* size of cbuf */
+    unsigned char *cbuf;  /* compressed block */
+    unsigned char *raw;   /* decoded block */
+    uint32_t crc;         /* its CRC32C, once checked */
+    DecodeTable *table;
+    DecodeTable *context; /* HUF_MAX_CONTEXT_TABLES tables for order-1 blocks */
+    uint64_t table_block; /* block whose table is in table, or UINT64_MAX */
+    const HufDict *dict;
+    HufStats stats;       /* this block's counters, summed when it is done */
+    JobSync *sync;
+    int ok;
+    int done;
+} DecodeJob;
+
+/*
+ * The blocks in flight of one file call (slots) and the workers coding
+ * them. A slot's jobs are two views of the same buffers: compression
+ * reads into raw and encodes into the packed buffer, decompression the
+ * other way round, and the order-1 counts of one share memory with the
+ * decode tables of the other.
+ */
+typedef struct {
+    size_t slots;            /* blocks in flight */
+    size_t block_size;       /* largest block a slot holds */
+    BlockJob *jobs;          /* slots for compression */
+    DecodeJob *decode_jobs;  /* the same slots for decompression */
+    BlockJob **rings;        /* the AsyncIo read and write queues, slots each */
+    unsigned char *mem;      /* the slot buffers, one IO_ALIGN-aligned stride each */
+    ThreadPool *pool;        /* NULL with one thread */
+    size_t bytes;            /* heap held by all of the above */
+} Pipeline;
+
+/* stdio buffers of the files a context opens itself, so stdio does not allocate them */
+#define STDIO_BUF_SIZE (1 << 14)
+
+/*
+ * Codec context: options plus every buffer a sequential call needs. The
+ * block buffers are sized for opt.block_size up front and only grow when a
+ * stream to decode was written with larger blocks; with a memory budget
+ * nothing grows and the file functions' pipeline is held here as well.
+ */
+struct HufCtx {
+    HufOptions opt;
+    unsigned char *block;   /* one compressed block (or a block payload being read) */
+    unsigned char *raw;     /* one uncompressed block */
+    size_t block_cap;       /* block size the two buffers above hold */
+    DecodeTable table;
+    DecodeTable context[HUF_MAX_CONTEXT_TABLES]; /* order-1 decode tables */
+    uint32_t *pairs;        /* order-1 counts, if opt.context_tables */
+    HufDict *dict;          /* loaded trained table, or NULL */
+    HufDict *dict_mem;      /* storage for it, kept once allocated */
+    Pipeline *pipeline;     /* held with a memory budget, else made per call */
+    size_t held;            /* bytes of heap the context holds between calls */
+    HufStats stats;         /* of the last compress or decompress call */
+    unsigned char stdio_buf[2][STDIO_BUF_SIZE]; /* input, output */
+};
+
+/* -----------------------------
+   Utility helpers
+   ----------------------------- */
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n);
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void *xrealloc(void *p, size_t n) {
+    p = realloc(p, n);
+    if (!p) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * Buffers that may be read into with O_DIRECT: IO_ALIGN-aligned and padded
+ * to a multiple of it. Released with free().
+ */
+#define IO_ALIGN 4096
+
+static void *xmalloc_aligned(size_t n) {
+#ifdef HAVE_MMAP
+    void *p = NULL;
+    size_t padded = (n + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+    if (posix_memalign(&p, IO_ALIGN, padded ? padded : IO_ALIGN) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+#else
+    return xmalloc(n);
+#endif
+}
+
+/*
+ * Unaligned loads and stores of fixed-width fields. With GCC or Clang
+ * each is one memcpy (a plain move) plus a byte swap only when the host
+ * order differs; elsewhere the shift expressions compile to the same.
+ */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define HUF_HOST_LE (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+
+static inline void store_be64(unsigned char *p, uint64_t v) {
+    if (HUF_HOST_LE) v = __builtin_bswap64(v);
+    memcpy(p, &v, 8);
+}
+
+static inline uint64_t load_be64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return HUF_HOST_LE ? __builtin_bswap64(v) : v;
+}
+
+/* Little-endian fixed-width fields used by the container headers */
+static inline void store_le32(unsigned char *p, uint32_t v) {
+    if (!HUF_HOST_LE) v = __builtin_bswap32(v);
+    memcpy(p, &v, 4);
+}
+
+static inline uint32_t load_le32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return HUF_HOST_LE ? v : __builtin_bswap32(v);
+}
+
+static inline void store_le64(unsigned char *p, uint64_t v) {
+    if (!HUF_HOST_LE) v = __builtin_bswap64(v);
+    memcpy(p, &v, 8);
+}
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return HUF_HOST_LE ? v : __builtin_bswap64(v);
+}
+#else
+static inline void store_be64(unsigned char *p, uint64_t v) {
+    p[0] = (unsigned char)(v >> 56); p[1] = (unsigned char)(v >> 48);
+    p[2] = (unsigned char)(v >> 40); p[3] = (unsigned char)(v >> 32);
+    p[4] = (unsigned char)(v >> 24); p[5] = (unsigned char)(v >> 16);
+    p[6] = (unsigned char)(v >> 8);  p[7] = (unsigned char)v;
+}
+
+static inline uint64_t load_be64(const unsigned char *p) {
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+/* Little-endian fixed-width fields used by the container headers */
+static inline void store_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24);
+}
+
+static inline uint32_t load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store_le64(unsigned char *p, uint64_t v) {
+    store_le32(p, (uint32_t)v);
+    store_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    return (uint64_t)load_le32(p) | ((uint64_t)load_le32(p + 4) << 32);
+}
+#endif
+
+/*
+ * Stage timers feeding HufStats.stage_ns. With HUF_TIMING=0 they expand
+ * to nothing, so the block coders make no clock calls at all.
+ */
+#ifndef HUF_TIMING
+#define HUF_TIMING 1
+#endif
+
+#if HUF_TIMING
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#define STAGE_BEGIN(t) uint64_t t = clock_ns()
+#define STAGE_END(stats, stage, t) ((stats)->stage_ns[stage] += clock_ns() - (t))
+#else
+#define STAGE_BEGIN(t) ((void)0)
+#define STAGE_END(stats, stage, t) ((void)(stats))
+#endif
+
+/* Fold the counters of one thread or block into a running total */
+static void stats_add(HufStats *total, const HufStats *s) {
+    total->bytes_in += s->bytes_in;
+    total->bytes_out += s->bytes_out;
+    total->blocks += s->blocks;
+    total->stored_blocks += s->stored_blocks;
+    total->rle_blocks += s->rle_blocks;
+    total->repeat_blocks += s->repeat_blocks;
+    total->dict_blocks += s->dict_blocks;
+    total->context_blocks += s->context_blocks;
+    total->table_builds += s->table_builds;
+    total->coded_bytes += s->coded_bytes;
+    total->coded_bits += s->coded_bits;
+    total->entropy_bits += s->entropy_bits;
+    if (s->max_code_len > total->max_code_len) total->max_code_len = s->max_code_len;
+    for (int i = 0; i < HUF_STAGE_COUNT; ++i) total->stage_ns[i] += s->stage_ns[i];
+}
+
+/* -----------------------------
+   CRC32C (Castagnoli) block checksum
+   ----------------------------- */
+
+/*
+ * The CRC32 instruction of SSE4.2 (picked at run time) or ARMv8 (when the
+ * compiler targets it) does 8 bytes per step; the table is the portable
+ * fallback. All of them compute the same CRC.
+ */
+#define CRC32C_POLY 0x82F63B78u /* reflected */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_ARM 1
+#endif
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_x2n[67]; /* x^(2^k) mod P, for combining */
+static uint32_t (*crc32c_update)(uint32_t c, const unsigned char *p, size_t n);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_update_table(uint32_t c, const unsigned char *p, size_t n) {
+    for (size_t i = 0; i < n; ++i) c = crc32c_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t c, const unsigned char *p, size_t n) {
+#ifdef __x86_64__
+    uint64_t c64 = c;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+    }
+    c = (uint32_t)c64;
+#endif
+    for (; n >= 4; p += 4, n -= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        c = _mm_crc32_u32(c, v);
+    }
+    for (; n > 0; ++p, --n) c = _mm_crc32_u8(c, *p);
+    return c;
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARM
+static uint32_t crc32c_update_arm(uint32_t c, const unsigned char *p, size_t n) {
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    for (; n > 0; ++p, --n) c = __crc32cb(c, *p);
+    return c;
+}
+#endif
+
+/* a * b modulo the CRC polynomial, bit 31 holding x^0 */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        crc32c_table[i] = c;
+    }
+    uint32_t p = 1u << 30; /* x^1 */
+    for (int k = 0; k < 67; ++k) {
+        crc32c_x2n[k] = p;
+        p = crc32c_multmodp(p, p);
+    }
+    crc32c_update = crc32c_update_table;
+#ifdef HAVE_CRC32C_SSE42
+    if (__builtin_cpu_supports("sse4.2")) crc32c_update = crc32c_update_sse42;
+#elif defined(HAVE_CRC32C_ARM)
+    crc32c_update = crc32c_update_arm;
+#endif
+}
+
+static uint32_t crc32c(const unsigned char *p, size_t n) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_update(0xFFFFFFFFu, p, n) ^ 0xFFFFFFFFu;
+}
+
+/*
+ * CRC32C of A followed by B, from crc_a, crc_b and B's length alone, so
+ * a whole-stream checksum costs nothing beyond the per-block ones.
+ */
+static uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+    pthread_once(&crc32c_once, crc32c_init);
+    uint32_t x = 1u << 31; /* x^0, then x^(8 len_b) */
+    for (int k = 3; len_b; len_b >>= 1, k++)
+        if (len_b & 1) x = crc32c_multmodp(crc32c_x2n[k], x);
+    return crc32c_multmodp(x, crc_a) ^ crc_b;
+}
+
+/* -----------------------------
+   Min-heap (priority queue), kept for rebuilding legacy trees
+   ----------------------------- */
+
+static void heap_init(MinHeap *h, const HuffmanTree *tree) {
+    h->nodes = tree->nodes;
+    h->size = 0;
+}
+
+static void heap_swap(int16_t *a, int16_t *b) {
+    int16_t t = *a; *a = *b; *b = t;
+}
+
+static uint64_t heap_freq(const MinHeap *h, int idx) {
+    return h->nodes[h->data[idx]].freq;
+}
+
+static void heapify_up(MinHeap *h, int idx) {
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (heap_freq(h, parent) <= heap_freq(h, idx)) break;
+        heap_swap(&h->data[parent], &h->data[idx]);
+        idx = parent;
+    }
+}
+
+static void heapify_down(MinHeap *h, int idx) {
+    for (;;) {
+        int left = 2*idx + 1;
+        int right = 2*idx + 2;
+        int smallest = idx;
+        if (left < h->size && heap_freq(h, left) < heap_freq(h, smallest)) smallest = left;
+        if (right < h->size && heap_freq(h, right) < heap_freq(h, smallest)) smallest = right;
+        if (smallest == idx) break;
+        heap_swap(&h->data[idx], &h->data[smallest]);
+        idx = smallest;
+    }
+}
+
+/* Capacity is HUF_MAX_NODES, which no tree can exceed */
+static void heap_insert(MinHeap *h, int node) {
+    h->data[h->size++] = (int16_t)node;
+    heapify_up(h, h->size - 1);
+}
+
+static int heap_extract_min(MinHeap *h) {
+    if (h->size == 0) return -1;
+    int min = h->data[0];
+    h->data[0] = h->data[--h->size];
+    heapify_down(h, 0);
+    return min;
+}
+
+/* -----------------------------
+   Frequency counting
+   ----------------------------- */
+
+#define HIST_LANES 4              /* interleaved sub-histograms */
+#define HIST_CHUNK (1u << 30)     /* keeps each 32-bit lane counter from overflowing */
+
+/* Histogram helper for one slice of at most HIST_CHUNK bytes */
+static void count_chunk(const unsigned char *src, size_t n, uint64_t freq[256]) {
+    /*
+     * Runs of one byte value would make every increment wait for the
+     * previous store to the same counter. Spreading consecutive bytes over
+     * HIST_LANES separate tables breaks that dependency chain; the tables
+     * are summed once at the end (a loop the compiler vectorizes).
+     */
+    uint32_t lanes[HIST_LANES][256];
+    memset(lanes, 0, sizeof(lanes));
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t a, b;
+        memcpy(&a, src + i, 8);
+        memcpy(&b, src + i + 8, 8);
+        for (int k = 0; k < 8; k += 2) {
+            lanes[0][(a >> (8 * k)) & 0xFF]++;
+            lanes[1][(a >> (8 * k + 8)) & 0xFF]++;
+            lanes[2][(b >> (8 * k)) & 0xFF]++;
+            lanes[3][(b >> (8 * k + 8)) & 0xFF]++;
+        }
+    }
+    for (; i < n; ++i) lanes[0][src[i]]++;
+
+    for (int c = 0; c < 256; ++c)
+        freq[c] += (uint64_t)lanes[0][c] + lanes[1][c] + lanes[2][c] + lanes[3][c];
+}
+
+/* Add the byte counts of src[0..n) to freq (freq is not cleared) */
+static void count_frequencies(const unsigned char *src, size_t n, uint64_t freq[256]) {
+    while (n > 0) {
+        size_t chunk = n < HIST_CHUNK ? n : HIST_CHUNK;
+        count_chunk(src, chunk, freq);
+        src += chunk;
+        n -= chunk;
+    }
+}
+
+/*
+ * Approximate mode counts every sample-th chunk of a block, starting with
+ * the first; blocks of one chunk or less are counted in full.
+ */
+#define SAMPLE_CHUNK (16u << 10)
+
+/*
+ * Add the counts of the sampled chunks of src[0..n) (all of it when
+ * sample < 2) to freq. Returns the bytes counted.
+ */
+static size_t count_sampled(const unsigned char *src, size_t n, int sample, uint64_t freq[256]) {
+    size_t chunk = sample > 1 ? SAMPLE_CHUNK : n, counted = 0;
+    for (size_t start = 0; start < n; start += chunk * (size_t)(sample > 1 ? sample : 1)) {
+        size_t len = n - start < chunk ? n - start : chunk;
+        count_frequencies(src + start, len, freq);
+        counted += len;
+    }
+    return counted;
+}
+
+/*
+ * Scale counts from counted sampled bytes up to n, then raise every byte
+ * to at least 1 so that the ones the sample missed still get a code.
+ * Returns the new total.
+ */
+static uint64_t scale_sample(uint64_t freq[256], size_t counted, size_t n) {
+    uint64_t total = 0;
+    for (int i = 0; i < 256; ++i) {
+        freq[i] = freq[i] * n / counted;
+        if (freq[i] == 0) freq[i] = 1;
+        total += freq[i];
+    }
+    return total;
+}
+
+/* 1 if src[0..n) is one byte value repeated */
+static int is_run(const unsigned char *src, size_t n) {
+    return n < 2 || memcmp(src, src + 1, n - 1) == 0;
+}
+
+/*
+ * Count each byte of the sampled chunks of src[0..n) (all of it when
+ * sample < 2) under the byte before it (the first under 0) into
+ * pairs[prev * 256 + byte], which is cleared first. Returns the bytes
+ * counted.
+ */
+static size_t count_pairs(const unsigned char *src, size_t n, int sample, uint32_t *pairs) {
+    memset(pairs, 0, sizeof(uint32_t) * 256 * 256);
+    size_t chunk = sample > 1 ? SAMPLE_CHUNK : n, counted = 0;
+    for (size_t start = 0; start < n; start += chunk * (size_t)(sample > 1 ? sample : 1)) {
+        size_t end = n - start < chunk ? n : start + chunk;
+        unsigned prev = start ? src[start - 1] : 0;
+        for (size_t i = start; i < end; ++i) {
+            pairs[prev << 8 | src[i]]++;
+            prev = src[i];
+        }
+        counted += end - start;
+    }
+    return counted;
+}
+
+/*
+ * Shannon entropy of a histogram over n bytes, in bits: the least any
+ * prefix code (Huffman, a trained table or a reused one) can spend on it.
+ */
+static double entropy_bits(const uint64_t freq[256], size_t n) {
+    double bits = (double)n * log2((double)n);
+    for (int i = 0; i < 256; ++i)
+        if (freq[i]) bits -= (double)freq[i] * log2((double)freq[i]);
+    return bits;
+}
+
+/* -----------------------------
+   Huffman tree helpers (legacy files only; new code lengths never build a tree)
+   ----------------------------- */
+
+static int node_create(HuffmanTree *t, unsigned char ch, uint64_t freq, int left, int right) {
+    HuffmanNode *n = &t->nodes[t->count];
+    n->ch = ch;
+    n->freq = freq;
+    n->left = (int16_t)left;
+    n->right = (int16_t)right;
+    return t->count++;
+}
+
+static int node_is_leaf(const HuffmanNode *n) {
+    return n->left < 0;
+}
+
+/*
+ * Build Huffman tree from frequency table (256 entries) into t.
+ * Returns the root index or -1 if empty. The merge order (and so the
+ * tree shape) is what legacy files were written with; keep it.
+ */
+static int build_huffman_tree(const uint64_t freq[256], HuffmanTree *t) {
+    MinHeap heap;
+    t->count = 0;
+    t->root = -1;
+    heap_init(&heap, t);
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i] > 0) heap_insert(&heap, node_create(t, (unsigned char)i, freq[i], -1, -1));
+    }
+    if (heap.size == 0) return -1;
+
+    while (heap.size > 1) {
+        int a = heap_extract_min(&heap);
+        int b = heap_extract_min(&heap);
+        heap_insert(&heap, node_create(t, 0, t->nodes[a].freq + t->nodes[b].freq, a, b));
+    }
+
+    /* a lone symbol is its own root */
+    t->root = heap_extract_min(&heap);
+    return t->root;
+}
+
+/* -----------------------------
+   Code generation
+   ----------------------------- */
+
+/*
+ * Bytes that occur, ordered by (freq, byte). LSD radix sort one byte of
+ * the frequency at a time; it is stable and starts in byte order, and
+ * passes stop at the highest byte any frequency uses. Returns the count.
+ */
+static int sort_symbols_by_freq(const uint64_t freq[256], int sorted[256]) {
+    int tmp[256], n = 0;
+    uint64_t all = 0;
+    for (int i = 0; i < 256; ++i) if (freq[i] > 0) { sorted[n++] = i; all |= freq[i]; }
+
+    int *src = sorted, *dst = tmp;
+    for (int shift = 0; shift < 64 && (all >> shift) != 0; shift += 8) {
+        int pos[257] = { 0 };
+        for (int i = 0; i < n; ++i) pos[((freq[src[i]] >> shift) & 0xFF) + 1]++;
+        for (int d = 0; d < 256; ++d) pos[d + 1] += pos[d];
+        for (int i = 0; i < n; ++i) dst[pos[(freq[src[i]] >> shift) & 0xFF]++] = src[i];
+        int *t = src; src = dst; dst = t;
+    }
+    if (src != sorted) memcpy(sorted, src, sizeof(int) * (size_t)n);
+    return n;
+}
+
+/*
+ * Unlimited Huffman code length per byte (0 = unused), computed in place
+ * over the sorted weights (Moffat & Katajainen): the first pass merges
+ * the two-queue way and leaves parent links behind, the second turns them
+ * into internal node depths, the third hands out leaf depths.
+ */
+static void huffman_code_lengths(const uint64_t freq[256], unsigned char lengths[256]) {
+    int sym[256];
+    uint64_t a[256];
+    int n = sort_symbols_by_freq(freq, sym);
+    memset(lengths, 0, 256);
+    if (n == 0) return;
+    /* a lone symbol still needs one bit so the code is well-formed */
+    if (n == 1) { lengths[sym[0]] = 1; return; }
+    for (int i = 0; i < 256; ++i) a[i] = (i < n) ? freq[sym[i]] : 0;
+
+    int root = 0, leaf = 2, next;
+    a[0] += a[1];
+    for (next = 1; next < n - 1; ++next) {
+        if (leaf >= n || a[root] < a[leaf]) { a[next] = a[root]; a[root++] = (uint64_t)next; }
+        else a[next] = a[leaf++];
+        if (leaf >= n || (root < next && a[root] < a[leaf])) { a[next] += a[root]; a[root++] = (uint64_t)next; }
+        else a[next] += a[leaf++];
+    }
+
+    a[n - 2] = 0;
+    for (next = n - 3; next >= 0; --next) a[next] = a[a[next]] + 1;
+
+    int avail = 1, used = 0, depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avail > 0) {
+        while (root >= 0 && a[root] == (uint64_t)depth) { used++; root--; }
+        while (avail > used) { a[next--] = (uint64_t)depth; avail--; }
+        avail = 2 * used;
+        depth++;
+        used = 0;
+    }
+    for (int i = 0; i < n; ++i) lengths[sym[i]] = (unsigned char)a[i];
+}
+
+/*
+ * Optimal length-limited code lengths (package-merge / coin collector).
+ * Level 0 holds codes of length 1, level max_len-1 the deepest. Every level
+ * merges the sorted leaves with pairs packaged from the level below; the
+ * first 2n-2 items of level 0 are the solution, and every leaf picked at a
+ * level adds one bit to that symbol's code. Requires n >= 2 and
+ * 2^max_len >= n.
+ *
+ * Leaves enter each level in sorted order, so the first k items of a level
+ * always contain its k' lightest leaves. That means a level only has to
+ * remember which positions were leaves (one bit each) and the weights of
+ * the level below, all of which fit on the stack.
+ */
+static void package_merge_lengths(const uint64_t freq[256], int max_len, unsigned char lengths[256]) {
+    int leaves[256];
+    int n = sort_symbols_by_freq(freq, leaves);
+
+    uint64_t weight[2][2 * 256];
+    uint64_t is_leaf[HUF_MAX_CODE_LEN][2 * 256 / 64];
+    int size = n;
+    uint64_t *below = weight[0];
+    for (int i = 0; i < n; ++i) below[i] = freq[leaves[i]];
+    memset(is_leaf, 0, sizeof(is_leaf));
+    for (int i = 0; i < n; ++i) is_leaf[max_len - 1][i >> 6] |= 1ull << (i & 63);
+
+    for (int lvl = max_len - 2; lvl >= 0; --lvl) {
+        uint64_t *cur = (below == weight[0]) ? weight[1] : weight[0];
+        int npk = size / 2, li = 0, pi = 0, k = 0;
+        while (li < n || pi < npk) {
+            uint64_t pw = (pi < npk) ? below[2 * pi] + below[2 * pi + 1] : 0;
+            if (li < n && (pi == npk || freq[leaves[li]] <= pw)) {
+                cur[k] = freq[leaves[li++]];
+                is_leaf[lvl][k >> 6] |= 1ull << (k & 63);
+            } else {
+                cur[k] = pw;
+                pi++;
+            }
+            k++;
+        }
+        size = k;
+        below = cur;
+    }
+
+    memset(lengths, 0, 256);
+    int take = 2 * n - 2;
+    for (int lvl = 0; lvl < max_len && take > 0; ++lvl) {
+        int picked = 0;
+        for (int k = 0; k < take; ++k) picked += (int)((is_leaf[lvl][k >> 6] >> (k & 63)) & 1);
+        for (int i = 0; i < picked; ++i) lengths[leaves[i]]++;
+        take = 2 * (take - picked);
+    }
+}
+
+/*
+ * Huffman code lengths for freq with no code longer than max_len bits.
+ * Plain Huffman lengths are used when they already fit; otherwise the
+ * optimal limited lengths come from package-merge. max_len is raised to
+ * the minimum the alphabet needs. Returns the longest length used.
+ */
+static int build_code_lengths(const uint64_t freq[256], int max_len, unsigned char lengths[256]) {
+    huffman_code_lengths(freq, lengths);
+
+    int unique = 0, longest = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (lengths[i]) unique++;
+        if (lengths[i] > longest) longest = lengths[i];
+    }
+    int min_len = 1;
+    while ((1 << min_len) < unique) min_len++;
+    if (max_len < min_len) max_len = min_len;
+    if (longest <= max_len) return longest;
+
+    package_merge_lengths(freq, max_len, lengths);
+    return max_len;
+}
+
+/* Size of the encoded payload in bits for the given lengths */
+static uint64_t encoded_bits(const uint64_t freq[256], const unsigned char lengths[256]) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 256; ++i) bits += freq[i] * lengths[i];
+    return bits;
+}
+
+/*
+ * Assign canonical codes: shorter codes first, ties broken by byte value,
+ * each code the previous one plus one. next_code[len] receives the first
+ * code of each length (what a decoder needs to rebuild the same codes).
+ */
+static void canonical_next_codes(const unsigned char lengths[256], uint64_t next_code[HUF_MAX_CODE_LEN + 2]) {
+    int count[HUF_MAX_CODE_LEN + 1] = {0};
+    for (int i = 0; i < 256; ++i) count[lengths[i]]++;
+    count[0] = 0;
+    uint64_t code = 0;
+    for (int len = 1; len <= HUF_MAX_CODE_LEN; ++len) {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+}
+
+static void generate_codes(const unsigned char lengths[256], Code codes[256]) {
+    uint64_t next_code[HUF_MAX_CODE_LEN + 2];
+    canonical_next_codes(lengths, next_code);
+    for (int i = 0; i < 256; ++i) {
+        codes[i].len = lengths[i];
+        codes[i].code = lengths[i] ? (uint32_t)next_code[lengths[i]]++ : 0;
+    }
+}
+
+/* -----------------------------
+   Bit writing / reading
+   ----------------------------- */
+
+/*
+ * The helpers below are forced inline so each kernel built for its own
+ * instruction set (target attribute) gets its own copy of them.
+ */
+#if defined(__GNUC__)
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE static inline
+#endif
+
+static const BitKernels *bit_kernels(void);
+
+static void bitwriter_init(BitWriter *bw, unsigned char *dst) {
+    bw->buf = dst;
+    bw->pos = 0;
+    bw->acc = 0;
+    bw->bit_count = 0;
+}
+
+/* Append a code of len bits. Caller keeps bit_count + len <= 63 between flushes */
+KERNEL_INLINE void bitwriter_put(BitWriter *bw, uint32_t code, int len) {
+    bw->acc |= (uint64_t)code << (64 - bw->bit_count - len);
+    bw->bit_count += len;
+}
+
+/* Move whole bytes from acc into the buffer with one 8-byte store */
+KERNEL_INLINE void bitwriter_flush_bits(BitWriter *bw) {
+    store_be64(bw->buf + bw->pos, bw->acc);
+    int nbytes = bw->bit_count >> 3;
+    bw->pos += nbytes;
+    bw->acc <<= nbytes * 8;
+    bw->bit_count &= 7;
+}
+
+/* Write out the final partial byte. Returns total bytes written */
+static size_t bitwriter_finish(BitWriter *bw) {
+    store_be64(bw->buf + bw->pos, bw->acc);
+    bw->pos += (bw->bit_count + 7) >> 3;
+    return bw->pos;
+}
+
+/*
+ * Encode n bytes. As many codes as fit in 56 bits are gathered between
+ * flushes (three with the default 15-bit cap).
+ */
+KERNEL_INLINE void encode_bytes_body(BitWriter *bw, const Code codes[256], int max_len,
+                                    const unsigned char *src, size_t n) {
+    size_t per_flush = (size_t)(56 / max_len);
+    size_t i = 0;
+    while (i + per_flush <= n) {
+        for (size_t k = 0; k < per_flush; ++k) {
+            const Code *c = &codes[src[i + k]];
+            bitwriter_put(bw, c->code, c->len);
+        }
+        bitwriter_flush_bits(bw);
+        i += per_flush;
+    }
+    for (; i < n; ++i) {
+        bitwriter_put(bw, codes[src[i]].code, codes[src[i]].len);
+        bitwriter_flush_bits(bw);
+    }
+}
+
+/* Reader over a stream that refills from fp as it goes, cap bytes at a time into buf */
+static void bitreader_init_file(BitReader *br, FILE *fp, unsigned char *buf, size_t cap) {
+    br->fp = fp;
+    br->fbuf = buf;
+    br->fcap = cap;
+    br->buf = br->fbuf;
+    br->pos = br->len = 0;
+    br->acc = 0;
+    br->bit_count = 0;
+}
+
+/* Reader over an in-memory block of n bytes */
+static void bitreader_init_mem(BitReader *br, const unsigned char *src, size_t n) {
+    br->fp = NULL;
+    br->fbuf = NULL;
+    br->fcap = 0;
+    br->buf = src;
+    br->pos = 0;
+    br->len = n;
+    br->acc = 0;
+    br->bit_count = 0;
+}
+
+/* Byte-wise refill for the last 7 bytes of a block and for FILE-backed readers */
+static void bitreader_refill_slow(BitReader *br) {
+    while (br->bit_count <= 56) {
+        if (br->pos == br->len) {
+            if (!br->fp) return; /* end of block: remaining bits read as zero */
+            br->len = fread(br->fbuf, 1, br->fcap, br->fp);
+            br->pos = 0;
+            if (br->len == 0) return; /* EOF: remaining bits read as zero */
+        }
+        br->acc |= (uint64_t)br->buf[br->pos++] << (56 - br->bit_count);
+        br->bit_count += 8;
+    }
+}
+
+/* Top up acc to at least 57 valid bits, or as many as the input still has */
+KERNEL_INLINE void bitreader_refill(BitReader *br) {
+    if (br->bit_count > 56) return;
+    if (br->len - br->pos >= 8) {
+        /* one 8-byte load; bits past bit_count are simply read again next time */
+        br->acc |= load_be64(br->buf + br->pos) >> br->bit_count;
+        br->pos += (63 - br->bit_count) >> 3;
+        br->bit_count |= 56;
+        return;
+    }
+    bitreader_refill_slow(br);
+}
+
+/* Look at the next n bits (1..32) without consuming them */
+KERNEL_INLINE uint32_t bitreader_peek(const BitReader *br, int n) {
+    return (uint32_t)(br->acc >> (64 - n));
+}
+
+KERNEL_INLINE void bitreader_consume(BitReader *br, int n) {
+    br->acc <<= n;
+    br->bit_count -= n;
+}
+
+/* -----------------------------
+   Table-driven decoding
+   ----------------------------- */
+
+/* Fill table entries for every leaf reachable within HUF_TABLE_BITS bits */
+static void decode_table_fill(DecodeTable *t, int idx, uint32_t code, int depth) {
+    const HuffmanNode *node = &t->tree->nodes[idx];
+    if (node_is_leaf(node)) {
+        int shift = HUF_TABLE_BITS - depth;
+        uint32_t first = code << shift;
+        uint16_t e = (uint16_t)((depth << 8) | node->ch);
+        for (uint32_t i = 0; i < (1u << shift); ++i) t->entry[first + i] = e;
+        return;
+    }
+    if (depth == HUF_TABLE_BITS) {
+        t->entry[code] = 0; /* long code: slow path */
+        return;
+    }
+    decode_table_fill(t, node->left, code << 1, depth + 1);
+    decode_table_fill(t, node->right, (code << 1) | 1, depth + 1);
+}
+
+/* Build decode table from a tree with at least two leaves; tree must outlive t */
+static void decode_table_build(DecodeTable *t, const HuffmanTree *tree) {
+    memset(t->entry, 0, sizeof(t->entry));
+    t->tree = tree;
+    t->complete = 1;
+    decode_table_fill(t, tree->root, 0, 0);
+}
+
+/*
+ * Build decode table straight from canonical code lengths (no tree).
+ * Returns 0 if the lengths do not describe a valid prefix code: every
+ * code of two or more symbols must fill the code space exactly (Kraft
+ * equality), as an incomplete one leaves table entries that decode
+ * nothing; a lone symbol must have length 1.
+ */
+static int decode_table_build_canonical(DecodeTable *t, const unsigned char lengths[256]) {
+    memset(t->entry, 0, sizeof(t->entry));
+    memset(t->count, 0, sizeof(t->count));
+    t->tree = NULL;
+    t->max_len = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (lengths[i] > HUF_MAX_CODE_LEN) return 0;
+        t->count[lengths[i]]++;
+        if (lengths[i] > t->max_len) t->max_len = lengths[i];
+    }
+    t->count[0] = 0;
+    if (t->max_len == 0) return 0;
+
+    /* Kraft check: no length may use more code space than is left, and none may be left over */
+    int64_t left = 1;
+    int used = 0;
+    for (int len = 1; len <= t->max_len; ++len) {
+        left = (left << 1) - t->count[len];
+        used += t->count[len];
+        if (left < 0) return 0;
+        if (left > 512) left = 512; /* already more than 256 symbols can fill */
+    }
+    t->complete = (left == 0);
+    if (used == 1 ? t->max_len != 1 : !t->complete) return 0;
+
+    int pos = 0;
+    for (int len = 1; len <= t->max_len; ++len) {
+        t->offset[len] = pos;
+        for (int i = 0; i < 256; ++i) if (lengths[i] == len) t->symbols[pos++] = (unsigned char)i;
+    }
+    canonical_next_codes(lengths, t->first);
+
+    for (int len = 1; len <= t->max_len && len <= HUF_TABLE_BITS; ++len) {
+        int shift = HUF_TABLE_BITS - len;
+        for (int k = 0; k < t->count[len]; ++k) {
+            uint32_t first = (uint32_t)(t->first[len] + k) << shift;
+            uint16_t e = (uint16_t)((len << 8) | t->symbols[t->offset[len] + k]);
+            for (uint32_t i = 0; i < (1u << shift); ++i) t->entry[first + i] = e;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Slow path for canonical codes longer than HUF_TABLE_BITS. Codes never
+ * exceed HUF_MAX_CODE_LEN (32) bits, so one refill covers any symbol.
+ */
+static int decode_slow_canonical(const DecodeTable *t, BitReader *br) {
+    if (br->bit_count < t->max_len) bitreader_refill(br);
+    for (int len = HUF_TABLE_BITS + 1; len <= t->max_len; ++len) {
+        uint64_t idx = bitreader_peek(br, len) - t->first[len];
+        if (idx < (uint64_t)t->count[len]) {
+            if (len > br->bit_count) return -1; /* truncated */
+            bitreader_consume(br, len);
+            return t->symbols[t->offset[len] + (int)idx];
+        }
+    }
+    return -1; /* not a valid code */
+}
+
+/* Slow path: walk the tree one bit at a time. Returns symbol or -1 on EOF */
+static int decode_slow(const DecodeTable *t, BitReader *br) {
+    if (!t->tree) return decode_slow_canonical(t, br);
+    const HuffmanNode *nodes = t->tree->nodes;
+    const HuffmanNode *cur = &nodes[t->tree->root];
+    while (!node_is_leaf(cur)) {
+        if (br->bit_count == 0) {
+            bitreader_refill(br);
+            if (br->bit_count == 0) return -1;
+        }
+        cur = &nodes[(br->acc >> 63) ? cur->right : cur->left];
+        bitreader_consume(br, 1);
+    }
+    return cur->ch;
+}
+
+/* -----------------------------
+   Input views (mmap or buffered reads)
+   ----------------------------- */
+
+/*
+ * Open path for block-wise reading. Regular files are memory-mapped with a
+ * sequential-access hint so blocks are handed out without copying; pipes,
+ * devices and systems without mmap are read with fread. With direct set,
+ * a regular file is read with O_DIRECT instead, so a dump far larger than
+ * RAM streams through without evicting the page cache; block buffers must
+ * then come from xmalloc_aligned. Files too big for the address space (on
+ * 32-bit systems) are streamed. Returns 1 on success, 0 if the file
+ * cannot be opened.
+ */
+static int input_open(const char *path, int direct, InputView *v) {
+    memset(v, 0, sizeof(*v));
+    v->fd = -1;
+#ifdef HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return 0; }
+#ifdef O_DIRECT
+    if (direct && S_ISREG(st.st_mode)) {
+        int dfd = open(path, O_RDONLY | O_DIRECT);
+        if (dfd >= 0) {
+            close(fd);
+            v->fd = dfd;
+            return 1;
+        }
+    }
+#else
+    (void)direct;
+#endif
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            close(fd);
+            posix_madvise(p, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            v->data = p;
+            v->size = (uint64_t)st.st_size;
+            return 1;
+        }
+    }
+    v->fp = fdopen(fd, "rb");
+    if (!v->fp) { close(fd); return 0; }
+#else
+    (void)direct;
+    v->fp = fopen(path, "rb");
+    if (!v->fp) return 0;
+#endif
+    return 1;
+}
+
+#ifdef HAVE_MMAP
+/*
+ * Fill buf (IO_ALIGN-aligned) with up to max bytes from a direct
+ * descriptor. Only the last read of the file may come up short, so the
+ * file offset stays aligned. If the file system refuses O_DIRECT, the
+ * descriptor falls back to ordinary buffered reads.
+ */
+static size_t direct_read(InputView *v, unsigned char *buf, size_t max) {
+    size_t n = 0;
+    while (n < max) {
+        ssize_t r = read(v->fd, buf + n, max - n);
+        if (r > 0) { n += (size_t)r; continue; }
+        if (r == 0) break;
+#ifdef O_DIRECT
+        if (errno == EINVAL && (fcntl(v->fd, F_GETFL) & O_DIRECT)) {
+            fcntl(v->fd, F_SETFL, fcntl(v->fd, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+#endif
+        if (errno == EINTR) continue;
+        v->read_error = 1;
+        break;
+    }
+    return n;
+}
+#endif
+
+/*
+ * Fill buf with up to max bytes from the archive members, opening each in
+ * turn; a block ends only at the end of the last one. Each member is read
+ * unbuffered straight into buf, so a small file costs an open, one or two
+ * reads and a close. A member that cannot be opened is skipped with a
+ * warning; a read error fails the archive.
+ */
+static size_t members_read(InputView *v, unsigned char *buf, size_t max) {
+    size_t n = 0;
+    while (n < max && !v->read_error) {
+        ArchiveMember *m = &v->members[v->next_member];
+        if (!v->fp) {
+            if (v->next_member == v->nmembers) break;
+            v->fp = fopen(m->path, "rb");
+            if (!v->fp) {
+                fprintf(stderr, "Warning: skipping '%s': %s\n", m->path, strerror(errno));
+                m->size = ARCHIVE_SKIPPED;
+                v->next_member++;
+                continue;
+            }
+            setvbuf(v->fp, NULL, _IONBF, 0);
+            m->size = 0;
+        }
+        size_t got = fread(buf + n, 1, max - n, v->fp);
+        n += got;
+        m->size += got;
+        if (got > 0) continue;
+        if (ferror(v->fp)) {
+            fprintf(stderr, "Error: cannot read '%s'\n", m->path);
+            v->read_error = 1;
+        }
+        fclose(v->fp);
+        v->fp = NULL;
+        v->next_member++;
+    }
+    return n;
+}
+
+/* 1 if blocks point into a mapping (no per-block buffer needed) */
+static int input_is_mapped(const InputView *v) {
+    return v->data != NULL;
+}
+
+/*
+ * Next block of up to max bytes. Streamed input is read into scratch
+ * (max bytes); mapped input ignores it. Returns 0 at EOF.
+ */
+static size_t input_next_block(InputView *v, size_t max, unsigned char *scratch,
+                               const unsigned char **block) {
+    if (v->data) {
+        uint64_t left = v->size - v->pos;
+        size_t n = left < max ? (size_t)left : max;
+        *block = v->data + v->pos;
+        v->pos += n;
+        return n;
+    }
+    if (v->members) {
+        *block = scratch;
+        return members_read(v, scratch, max);
+    }
+#ifdef HAVE_MMAP
+    if (v->fd >= 0) {
+        *block = scratch;
+        return direct_read(v, scratch, max);
+    }
+#endif
+    size_t n = 0, got;
+    while (n < max && (got = fread(scratch + n, 1, max - n, v->fp)) > 0) n += got;
+    *block = scratch;
+    return n;
+}
+
+/* 1 if reading stopped because of an I/O error rather than EOF */
+static int input_error(const InputView *v) {
+    return v->read_error || (v->fp && !v->members && ferror(v->fp));
+}
+
+static void input_close(InputView *v) {
+#ifdef HAVE_MMAP
+    if (v->data) munmap((void *)v->data, (size_t)v->size);
+    if (v->fd >= 0) close(v->fd);
+#endif
+    if (v->fp) fclose(v->fp);
+    memset(v, 0, sizeof(*v));
+    v->fd = -1;
+}
+
+/* -----------------------------
+   Thread pool (work stealing)
+   ----------------------------- */
+
+/*
+ * Every worker owns a deque of tasks. Submitted tasks are dealt to the
+ * deques round-robin; a worker whose deque is empty steals from the
+ * others. Owners and thieves both take the oldest task first, because
+ * the block writer consumes results in submission order.
+ */
+static void deque_init(TaskDeque *d, size_t capacity) {
+    pthread_mutex_init(&d->mu, NULL);
+    d->ring = xmalloc(sizeof(Task) * capacity);
+    d->mask = capacity - 1;
+    d->head = d->tail = 0;
+}
+
+static void deque_push(TaskDeque *d, Task t) {
+    pthread_mutex_lock(&d->mu);
+    d->ring[d->tail++ & d->mask] = t;
+    pthread_mutex_unlock(&d->mu);
+}
+
+/* Take the oldest task. Returns 1 if one was available */
+static int deque_take(TaskDeque *d, Task *t) {
+    pthread_mutex_lock(&d->mu);
+    int got = (d->head != d->tail);
+    if (got) *t = d->ring[d->head++ & d->mask];
+    pthread_mutex_unlock(&d->mu);
+    return got;
+}
+
+/* Own deque first, then steal from the others starting at the next one */
+static int pool_find_task(ThreadPool *p, int self, Task *t) {
+    for (int k = 0; k < p->nthreads; ++k) {
+        if (deque_take(&p->deques[(self + k) % p->nthreads], t)) return 1;
+    }
+    return 0;
+}
+
+static void *pool_worker(void *arg) {
+    WorkerArg *w = arg;
+    ThreadPool *p = w->pool;
+    for (;;) {
+        pthread_mutex_lock(&p->mu);
+        while (p->pending == 0 && !p->stop) pthread_cond_wait(&p->cv, &p->mu);
+        if (p->pending == 0 && p->stop) { pthread_mutex_unlock(&p->mu); break; }
+        p->pending--; /* claim one task; it is already in some deque */
+        pthread_mutex_unlock(&p->mu);
+
+        Task t;
+        while (!pool_find_task(p, w->index, &t)) {}
+        t.fn(t.arg);
+    }
+    return NULL;
+}
+
+/* Pool of nthreads workers; at most max_queued tasks may be waiting at once */
+static ThreadPool *pool_create(int nthreads, size_t max_queued) {
+    ThreadPool *p = xmalloc(sizeof(ThreadPool));
+    size_t capacity = 1;
+    while (capacity < max_queued) capacity <<= 1;
+    p->nthreads = nthreads;
+    p->deques = xmalloc(sizeof(TaskDeque) * nthreads);
+    for (int i = 0; i < nthreads; ++i) deque_init(&p->deques[i], capacity);
+    p->next_deque = 0;
+    pthread_mutex_init(&p->mu, NULL);
+    pthread_cond_init(&p->cv, NULL);
+    p->pending = 0;
+    p->stop = 0;
+    p->threads = xmalloc(sizeof(pthread_t) * nthreads);
+    p->args = xmalloc(sizeof(WorkerArg) * nthreads);
+    for (int i = 0; i < nthreads; ++i) {
+        p->args[i].pool = p;
+        p->args[i].index = i;
+        if (pthread_create(&p->threads[i], NULL, pool_worker, &p->args[i]) != 0) {
+            fprintf(stderr, "Thread creation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return p;
+}
+
+/* Heap pool_create takes for the same arguments */
+static size_t pool_bytes(int nthreads, size_t max_queued) {
+    size_t capacity = 1;
+    while (capacity < max_queued) capacity <<= 1;
+    return sizeof(ThreadPool) +
+           (size_t)nthreads * (sizeof(TaskDeque) + sizeof(Task) * capacity + sizeof(pthread_t) + sizeof(WorkerArg));
+}
+
+static void pool_submit(ThreadPool *p, TaskFn fn, void *arg) {
+    Task t = { fn, arg };
+    deque_push(&p->deques[p->next_deque], t);
+    p->next_deque = (p->next_deque + 1) % (size_t)p->nthreads;
+    pthread_mutex_lock(&p->mu);
+    p->pending++;
+    pthread_cond_signal(&p->cv);
+    pthread_mutex_unlock(&p->mu);
+}
+
+/* Finish queued tasks, join the workers and free the pool */
+static void pool_destroy(ThreadPool *p) {
+    if (!p) return;
+    pthread_mutex_lock(&p->mu);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cv);
+    pthread_mutex_unlock(&p->mu);
+    for (int i = 0; i < p->nthreads; ++i) pthread_join(p->threads[i], NULL);
+    for (int i = 0; i < p->nthreads; ++i) {
+        pthread_mutex_destroy(&p->deques[i].mu);
+        free(p->deques[i].ring);
+    }
+    pthread_mutex_destroy(&p->mu);
+    pthread_cond_destroy(&p->cv);
+    free(p->args);
+    free(p->threads);
+    free(p->deques);
+    free(p);
+}
+
+/* Number of online CPUs, at least 1 */
+static int cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0) return n > HUF_MAX_THREADS ? HUF_MAX_THREADS : (int)n;
+#endif
+    return 1;
+}
+
+/* -----------------------------
+   Block coding
+   ----------------------------- */
+
+/*
+ * Compressed file format (version 4):
+ * [4 bytes] magic "HUF" + version byte (HUF_VERSION)
+ * [4 bytes] feature flags (FEATURE_*); a reader rejects bits it does not know
+ * [varint]  block size: uncompressed bytes per block (the last may be shorter)
+ * blocks, each:
+ *   [1 byte]  type (BLOCK_STORED, BLOCK_HUFFMAN, BLOCK_HUFFMAN4,
+ *             BLOCK_HUFFMAN_DICT, BLOCK_REPEAT, BLOCK_REPEAT4, BLOCK_RLE
+ *             or, with FEATURE_CONTEXT, BLOCK_CONTEXT), plus BLOCK_FULL if
+ *             it holds exactly block size bytes
+ *   [varint]  uncompressed size of this block, only without BLOCK_FULL
+ *   [4 bytes] payload size
+ *   [4 bytes] CRC32C of the uncompressed block
+ *   [payload] STORED: the raw bytes
+ *             HUFFMAN: code length of each byte 0..255 (zero runs packed as
+ *             (0, run - 1)) followed by the canonical-code bitstream
+ *             (MSB-first in each byte), omitted for a single distinct byte
+ *             HUFFMAN4: code lengths as above, then the sizes of streams
+ *             0..2 (4 bytes each), then four bitstreams coding the four
+ *             contiguous quarters of the block (ceil(n / 4) bytes each,
+ *             the last one shorter)
+ *             HUFFMAN_DICT: ID of a trained table (4 bytes) followed by a
+ *             bitstream coded with that table, which the decoder must have
+ *             REPEAT / REPEAT4: how many blocks back (4 bytes) the last
+ *             HUFFMAN or HUFFMAN4 block with two or more distinct bytes
+ *             is, then a bitstream (REPEAT) or jump table and four
+ *             bitstreams (REPEAT4) coded with that block's table
+ *             RLE: the one byte every position of the block holds
+ *             CONTEXT: number of tables k (1 byte, 2..8), which table
+ *             follows each byte value 0..255 (4 bits each, two per byte,
+ *             low nibble first), k code-length tables packed as above,
+ *             then one bitstream in which each byte is coded with the
+ *             table of the byte before it (the first byte with that of 0)
+ * [1 byte]  BLOCK_END
+ * [8 bytes] total uncompressed bytes
+ * [4 bytes] CRC32C of all uncompressed bytes (the block CRCs combined),
+ *           with FEATURE_STREAM_CRC
+ * block index (with FEATURE_INDEX), one entry per block:
+ *   [varint]  compressed size of the block, header included
+ *   [varint]  uncompressed size of the block
+ * [8 bytes] size of the index entries in bytes
+ * [4 bytes] CRC32C of the index entries
+ * [4 bytes] index magic "HUFI"
+ * directory (with FEATURE_DIRECTORY: an archive of many files, whose
+ * blocks hold the files back to back in directory order), one entry per
+ * file, sorted by name (bytewise):
+ *   [varint]  name length, then the name ("/"-separated, relative)
+ *   [varint]  uncompressed size of the file (up to 64 bits)
+ * [8 bytes] size of the directory entries in bytes
+ * [4 bytes] CRC32C of the directory entries
+ * [4 bytes] directory magic "HUFA"
+ *
+ * Fixed-width fields are little-endian; varints are LEB128 (7 bits per
+ * byte, low first, high bit set on all but the last). A one-block file
+ * carries about 50 bytes of framing. Every block carries its own table, so
+ * the encoder and decoder need only one block in memory at a time. A
+ * streaming decoder stops at BLOCK_END; a seekable one can read the index
+ * from the fixed-size trailer and decode blocks independently.
+ *
+ * Older versions, still decoded, have fixed-width fields throughout: a
+ * 4-byte block size and no flags word, 13-byte block headers (type, then
+ * uncompressed size, payload size and CRC, 4 bytes each), 12-byte index
+ * entries (8-byte file offset and 4-byte uncompressed size) and an entry
+ * count in place of the index size. Version 3 has the stream CRC and the
+ * index, version 2 only the index.
+ *
+ * Trained table (dictionary) file:
+ * [4 bytes] magic "HUFD"
+ * [4 bytes] table ID
+ * [n bytes] code lengths, packed as in a HUFFMAN block
+ * [4 bytes] CRC32C of everything before it
+ *
+ * Legacy format (no magic, still decoded):
+ * [8 bytes] uint64_t total_original_bytes (host byte order)
+ * [256 * 8 bytes] uint64_t frequencies[256]
+ * [N bytes] packed compressed bitstream (MSB-first in each byte)
+ */
+#define HUF_MAGIC "HUF"
+#define HUF_VERSION 4
+#define HUF_OLDEST_VERSION 2
+#define FILE_HEADER_MAX 13          /* magic, flags and a 5-byte varint */
+
+enum {
+    FEATURE_STREAM_CRC = 1u << 0, FEATURE_INDEX = 1u << 1, FEATURE_DIRECTORY = 1u << 2,
+    FEATURE_CONTEXT = 1u << 3       /* blocks may be BLOCK_CONTEXT */
+};
+#define FEATURES_KNOWN (FEATURE_STREAM_CRC | FEATURE_INDEX | FEATURE_DIRECTORY | FEATURE_CONTEXT)
+#define FEATURES_FILE (FEATURE_STREAM_CRC | FEATURE_INDEX)
+
+enum {
+    BLOCK_END = 0, BLOCK_STORED = 1, BLOCK_HUFFMAN = 2, BLOCK_HUFFMAN4 = 3,
+    BLOCK_HUFFMAN_DICT = 4, BLOCK_REPEAT = 5, BLOCK_REPEAT4 = 6, BLOCK_RLE = 7, BLOCK_CONTEXT = 8
+};
+#define BLOCK_FULL 0x80             /* type flag: raw size is the block size */
+#define BLOCK_HEADER_MAX 14         /* type, 5-byte varint, payload size, CRC */
+#define BLOCK_HEADER_V3 13          /* fixed-width block header of versions 2 and 3 */
+#define END_BLOCK_SIZE 13
+#define END_BLOCK_SIZE_NO_CRC 9
+#define CODE_LENGTHS_MAX 512
+#define JUMP_TABLE_SIZE 12          /* sizes of the first three of four streams */
+#define MULTISTREAM_MIN_BLOCK 1024  /* smaller blocks are not worth splitting */
+#define DICT_ID_SIZE 4
+#define REPEAT_BACK_SIZE 4
+#define DICT_ONLY_BLOCK 4096        /* smaller blocks take a trained table as is */
+#define CONTEXT_MAP_SIZE 128        /* 256 table numbers, 4 bits each */
+#define CONTEXT_MIN_BLOCK 32768     /* smaller blocks are not planned order-1 */
+#define CONTEXT_ROUNDS 4            /* clustering passes */
+#define HUF_DICT_MAGIC "HUFD"
+#define HUF_INDEX_MAGIC "HUFI"
+#define INDEX_ENTRY_MAX 10          /* two 5-byte varints */
+#define INDEX_ENTRY_V3 12
+#define INDEX_TRAILER_SIZE 16
+#define VARINT_MAX 5                /* bytes of a 32-bit varint */
+#define VARINT64_MAX 10
+#define HUF_ARCHIVE_MAGIC "HUFA"
+#define DIRECTORY_TRAILER_SIZE 16
+
+/* Worst-case size of one compressed block; Huffman output never exceeds stored */
+static size_t block_bound(size_t n) {
+    return BLOCK_HEADER_MAX + n + 8; /* + slack for the bit writer's 8-byte stores */
+}
+
+/* Append v as a varint. Returns bytes written (1..VARINT64_MAX) */
+static size_t put_varint64(unsigned char *dst, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (unsigned char)v;
+    return n;
+}
+
+static size_t put_varint(unsigned char *dst, uint32_t v) {
+    return put_varint64(dst, v);
+}
+
+/* Read a varint from src[0..n). Returns bytes used, 0 if truncated or over 64 bits */
+static size_t get_varint64(const unsigned char *src, size_t n, uint64_t *v) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < n && i < VARINT64_MAX; ++i) {
+        uint64_t bits = src[i] & 0x7F;
+        if (i == VARINT64_MAX - 1 && bits > 1) return 0;
+        x |= bits << (7 * i);
+        if (!(src[i] & 0x80)) {
+            *v = x;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Same, for a varint of at most 32 bits */
+static size_t get_varint(const unsigned char *src, size_t n, uint32_t *v) {
+    uint64_t x;
+    size_t len = get_varint64(src, n < VARINT_MAX ? n : VARINT_MAX, &x);
+    if (len == 0 || x > UINT32_MAX) return 0;
+    *v = (uint32_t)x;
+    return len;
+}
+
+static size_t put_file_header(unsigned char dst[FILE_HEADER_MAX], uint32_t block_size, uint32_t features) {
+    memcpy(dst, HUF_MAGIC, 3);
+    dst[3] = HUF_VERSION;
+    store_le32(dst + 4, features);
+    return 8 + put_varint(dst + 8, block_size);
+}
+
+/* Feature flags of a stream written with opt */
+static uint32_t stream_features(const HufOptions *opt) {
+    return FEATURES_FILE | (opt->context_tables ? FEATURE_CONTEXT : 0);
+}
+
+static int version_supported(int version) {
+    return version >= HUF_OLDEST_VERSION && version <= HUF_VERSION;
+}
+
+/*
+ * Parse the file header in src[0..n) (n may run past it). Returns its
+ * size, 0 if it is truncated, not ours or asks for unknown features.
+ */
+static size_t parse_file_header(const unsigned char *src, size_t n, FrameInfo *f) {
+    if (n < 8 || memcmp(src, HUF_MAGIC, 3) != 0 || !version_supported(src[3])) return 0;
+    f->version = src[3];
+    if (f->version >= 4) {
+        f->features = load_le32(src + 4);
+        size_t len = get_varint(src + 8, n - 8, &f->block_size);
+        if (len == 0 || (f->features & ~FEATURES_KNOWN)) return 0;
+        f->header_size = 8 + len;
+    } else {
+        f->features = FEATURE_INDEX | (f->version >= 3 ? FEATURE_STREAM_CRC : 0);
+        f->block_size = load_le32(src + 4);
+        f->header_size = 8;
+    }
+    if (f->block_size < HUF_MIN_BLOCK_SIZE || f->block_size > HUF_MAX_BLOCK_SIZE) return 0;
+    f->end_size = (f->features & FEATURE_STREAM_CRC) ? END_BLOCK_SIZE : END_BLOCK_SIZE_NO_CRC;
+    return f->header_size;
+}
+
+/* Header bytes put_block_header will write for a block of n bytes */
+static size_t block_header_size(size_t n, size_t block_size) {
+    unsigned char tmp[VARINT_MAX];
+    return 9 + (n == block_size ? 0 : put_varint(tmp, (uint32_t)n));
+}
+
+static size_t put_block_header(unsigned char *dst, const BlockHeader *h, size_t block_size) {
+    size_t pos = 1;
+    dst[0] = (unsigned char)h->type;
+    if (h->raw_size == block_size) dst[0] |= BLOCK_FULL;
+    else pos += put_varint(dst + 1, h->raw_size);
+    store_le32(dst + pos, h->payload_size);
+    store_le32(dst + pos + 4, h->crc);
+    return pos + 8;
+}
+
+/*
+ * Parse a block header (type byte not BLOCK_END) from src[0..n). Returns
+ * its size, 0 if src is too short or the header malformed.
+ */
+static size_t parse_block_header(const FrameInfo *f, const unsigned char *src, size_t n, BlockHeader *h) {
+    size_t pos = 1;
+    if (n < 1) return 0;
+    if (f->version < 4) {
+        if (n < BLOCK_HEADER_V3) return 0;
+        h->type = src[0];
+        h->raw_size = load_le32(src + 1);
+        pos = 5;
+    } else {
+        h->type = src[0] & ~BLOCK_FULL;
+        if (src[0] & BLOCK_FULL) {
+            h->raw_size = f->block_size;
+        } else {
+            size_t len = get_varint(src + 1, n - 1, &h->raw_size);
+            if (len == 0) return 0;
+            pos += len;
+        }
+    }
+    if (n - pos < 8 || h->raw_size == 0 || h->raw_size > f->block_size) return 0;
+    h->payload_size = load_le32(src + pos);
+    h->crc = load_le32(src + pos + 4);
+    return pos + 8;
+}
+
+static void put_end_block(unsigned char dst[END_BLOCK_SIZE], uint64_t total, uint32_t crc) {
+    dst[0] = BLOCK_END;
+    store_le64(dst + 1, total);
+    store_le32(dst + 9, crc);
+}
+
+/* Append the index entry of a block of size compressed bytes holding n. Returns bytes written */
+static size_t put_index_entry(unsigned char *dst, size_t size, size_t n) {
+    size_t len = put_varint(dst, (uint32_t)size);
+    return len + put_varint(dst + len, (uint32_t)n);
+}
+
+/* Trailer for the index_bytes bytes of index entries stored at index */
+static void put_index_trailer(unsigned char dst[INDEX_TRAILER_SIZE], const unsigned char *index, size_t index_bytes) {
+    store_le64(dst, index_bytes);
+    store_le32(dst + 8, crc32c(index, index_bytes));
+    memcpy(dst + 12, HUF_INDEX_MAGIC, 4);
+}
+
+/* Bytes of index entries, from the first trailer field (an entry count before version 4) */
+static uint64_t index_size(const FrameInfo *f, uint64_t field) {
+    if (f->version >= 4) return field;
+    return field > UINT64_MAX / INDEX_ENTRY_V3 ? UINT64_MAX : field * INDEX_ENTRY_V3;
+}
+
+/*
+ * Size of the block stream in a file of file_size bytes ending in tail:
+ * the whole file, less an archive's directory and its trailer. Returns 0
+ * if the directory trailer is missing or malformed.
+ */
+static uint64_t block_stream_size(const FrameInfo *f, const unsigned char tail[DIRECTORY_TRAILER_SIZE],
+                                  uint64_t file_size) {
+    if (!(f->features & FEATURE_DIRECTORY)) return file_size;
+    if (file_size < f->header_size + DIRECTORY_TRAILER_SIZE || memcmp(tail + 12, HUF_ARCHIVE_MAGIC, 4) != 0) return 0;
+    uint64_t dir_bytes = load_le64(tail);
+    if (dir_bytes > file_size - f->header_size - DIRECTORY_TRAILER_SIZE) return 0;
+    return file_size - DIRECTORY_TRAILER_SIZE - dir_bytes;
+}
+
+/* Pack 256 code lengths with runs of unused bytes collapsed. Returns bytes written */
+static size_t put_code_lengths(unsigned char *dst, const unsigned char lengths[256]) {
+    size_t n = 0;
+    for (int i = 0; i < 256; ) {
+        if (lengths[i] != 0) { dst[n++] = lengths[i++]; continue; }
+        int run = 0;
+        while (i < 256 && lengths[i] == 0) { run++; i++; }
+        dst[n++] = 0;
+        dst[n++] = (unsigned char)(run - 1);
+    }
+    return n;
+}
+
+/* Unpack code lengths from src[0..n). Returns bytes consumed, 0 if malformed */
+static size_t get_code_lengths(const unsigned char *src, size_t n, unsigned char lengths[256]) {
+    size_t pos = 0;
+    for (int i = 0; i < 256; ) {
+        if (pos >= n) return 0;
+        unsigned char c = src[pos++];
+        if (c != 0) { lengths[i++] = c; continue; }
+        if (pos >= n || i + src[pos] + 1 > 256) return 0;
+        int run = src[pos++] + 1;
+        memset(lengths + i, 0, run);
+        i += run;
+    }
+    return pos;
+}
+
+/* Payload size of src coded with a trained table, SIZE_MAX if it lacks a byte */
+static size_t dict_payload_size(const HufDict *dict, const uint64_t freq[256]) {
+    if (!dict) return SIZE_MAX;
+    uint64_t bits = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i] && !dict->lengths[i]) return SIZE_MAX;
+        bits += freq[i] * dict->lengths[i];
+    }
+    return DICT_ID_SIZE + (size_t)((bits + 7) / 8);
+}
+
+/* Payload bits of freq coded with lengths, UINT64_MAX if a byte has no code */
+static uint64_t reuse_bits(const unsigned char lengths[256], const uint64_t freq[256]) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i] && !lengths[i]) return UINT64_MAX;
+        bits += freq[i] * lengths[i];
+    }
+    return bits;
+}
+
+/* Bitstream bytes for bits of payload, as one stream or four plus their jump table */
+static size_t streams_size(uint64_t bits, int split) {
+    /* four streams cost the jump table plus up to one padding byte each */
+    return (size_t)((bits + 7) / 8) + (split ? JUMP_TABLE_SIZE + 4 : 0);
+}
+
+/* Bits per byte under histogram h of total bytes, smoothed so unseen bytes cost a lot but not infinitely */
+static void bit_costs(const uint64_t h[256], uint64_t total, double cost[256]) {
+    double base = log2((double)total + 128.0);
+    for (int i = 0; i < 256; ++i) cost[i] = base - log2((double)h[i] + 0.5);
+}
+
+/* Estimated bits of one context's counts coded at cost */
+static double row_cost(const uint32_t row[256], const double cost[256]) {
+    double bits = 0;
+    for (int i = 0; i < 256; ++i) bits += row[i] * cost[i];
+    return bits;
+}
+
+/*
+ * Plan src[0..n) order-1 with up to opt->context_tables tables. The 256
+ * previous-byte contexts are clustered k-means style: seeds are picked
+ * farthest-first (the context that loses most over its own entropy under
+ * the seeds so far), then each context moves to the cluster that codes
+ * it in the fewest bits and the clusters are recounted, for up to
+ * CONTEXT_ROUNDS rounds. Each cluster's table is built like a block's.
+ */
+static void plan_context(const unsigned char *src, size_t n, const HufOptions *opt, uint32_t *pairs,
+                         ContextPlan *cp, HufStats *st) {
+    STAGE_BEGIN(t0);
+    size_t counted = count_pairs(src, n, opt->sample, pairs);
+    STAGE_END(st, HUF_STAGE_HISTOGRAM, t0);
+
+    STAGE_BEGIN(t1);
+    uint64_t rows[256];
+    double self[256], loss[256];
+    double order1 = 0;
+    int active = 0, first = 0;
+    for (int x = 0; x < 256; ++x) {
+        const uint32_t *row = pairs + 256 * x;
+        rows[x] = 0;
+        for (int i = 0; i < 256; ++i) rows[x] += row[i];
+        self[x] = 0;
+        loss[x] = HUGE_VAL;
+        for (int i = 0; i < 256; ++i)
+            if (row[i]) self[x] += row[i] * log2((double)rows[x] / row[i]);
+        order1 += self[x];
+        if (rows[x]) active++;
+        if (rows[x] > rows[first]) first = x;
+    }
+    cp->tables = 0;
+    if (active < 2) {
+        STAGE_END(st, HUF_STAGE_LENGTHS, t1);
+        return;
+    }
+
+    /* seeds: a new table must win back at least a small one's size */
+    uint64_t hist[HUF_MAX_CONTEXT_TABLES][256], total[HUF_MAX_CONTEXT_TABLES];
+    double cost[HUF_MAX_CONTEXT_TABLES][256];
+    int k = 0, seed = first;
+    while (k < opt->context_tables) {
+        for (int i = 0; i < 256; ++i) hist[k][i] = pairs[256 * seed + i];
+        bit_costs(hist[k], rows[seed], cost[k]);
+        k++;
+        seed = -1;
+        for (int x = 0; x < 256; ++x) {
+            if (!rows[x]) continue;
+            double d = row_cost(pairs + 256 * x, cost[k - 1]) - self[x];
+            if (d < loss[x]) loss[x] = d;
+            if (loss[x] > 8.0 * 64 && (seed < 0 || loss[x] > loss[seed])) seed = x;
+        }
+        if (seed < 0) break;
+    }
+
+    unsigned char assign[256];
+    memset(assign, 0, sizeof(assign));
+    for (int round = 0; round < CONTEXT_ROUNDS; ++round) {
+        int moved = 0;
+        for (int x = 0; x < 256; ++x) {
+            if (!rows[x]) continue;
+            int best = 0;
+            double best_bits = HUGE_VAL;
+            for (int c = 0; c < k; ++c) {
+                double bits = row_cost(pairs + 256 * x, cost[c]);
+                if (bits < best_bits) { best_bits = bits; best = c; }
+            }
+            if (round == 0 || assign[x] != best) moved++;
+            assign[x] = (unsigned char)best;
+        }
+        memset(hist, 0, sizeof(hist));
+        memset(total, 0, sizeof(total));
+        for (int x = 0; x < 256; ++x) {
+            if (!rows[x]) continue;
+            for (int i = 0; i < 256; ++i) hist[assign[x]][i] += pairs[256 * x + i];
+            total[assign[x]] += rows[x];
+        }
+        if (!moved) break;
+        for (int c = 0; c < k; ++c) if (total[c]) bit_costs(hist[c], total[c], cost[c]);
+    }
+
+    /* number the clusters that kept members in order of first use */
+    int number[HUF_MAX_CONTEXT_TABLES], used = 0;
+    for (int c = 0; c < k; ++c) number[c] = -1;
+    for (int x = 0; x < 256; ++x) {
+        if (!rows[x]) { cp->map[x] = 0; continue; }
+        if (number[assign[x]] < 0) number[assign[x]] = used++;
+        cp->map[x] = (unsigned char)number[assign[x]];
+    }
+    if (used < 2) {
+        STAGE_END(st, HUF_STAGE_LENGTHS, t1);
+        return;
+    }
+    size_t tables_size = 0;
+    cp->bits = 0;
+    for (int c = 0; c < k; ++c) {
+        if (number[c] < 0) continue;
+        unsigned char *lengths = cp->lengths[number[c]];
+        unsigned char packed[CODE_LENGTHS_MAX];
+        if (counted < n) scale_sample(hist[c], counted, n);
+        build_code_lengths(hist[c], opt->max_code_len, lengths);
+        tables_size += put_code_lengths(packed, lengths);
+        cp->bits += encoded_bits(hist[c], lengths);
+    }
+    cp->tables = used;
+    cp->entropy = order1 * (double)n / (double)counted;
+    cp->size = 1 + CONTEXT_MAP_SIZE + tables_size + (size_t)((cp->bits + 7) / 8);
+    st->table_builds += (uint64_t)used;
+    STAGE_END(st, HUF_STAGE_LENGTHS, t1);
+}
+
+/*
+ * Count a block and build its own length-limited table, unless it is a
+ * single run, its entropy leaves no room to beat storing it (any coded
+ * payload costs at least the entropy plus a byte of table or ID), or a
+ * trained table will do (blocks under DICT_ONLY_BLOCK that it covers).
+ * With pairs (256 x 256 scratch) a large block is also planned order-1.
+ * With opt->sample only a sample is counted; freq is then scaled up from
+ * it with every byte present, unless the whole block turns out to be one
+ * run.
+ */
+static void plan_block(const unsigned char *src, size_t n, const HufOptions *opt, const HufDict *dict,
+                       uint32_t *pairs, BlockPlan *p, HufStats *st) {
+    STAGE_BEGIN(t0);
+    memset(p->freq, 0, sizeof(p->freq));
+    size_t counted = count_sampled(src, n, opt->sample, p->freq);
+    p->built = 0;
+    p->context.tables = 0;
+    p->unique = 0;
+    for (int i = 0; i < 256; ++i) if (p->freq[i]) p->unique++;
+    uint64_t total = n;
+    if (counted < n && p->unique == 1 && is_run(src, n)) {
+        p->freq[src[0]] = n;
+    } else if (counted < n) {
+        total = scale_sample(p->freq, counted, n);
+        p->unique = 256;
+    }
+    p->entropy = (p->unique == 1) ? 0.0 : entropy_bits(p->freq, (size_t)total);
+    STAGE_END(st, HUF_STAGE_HISTOGRAM, t0);
+    if (p->unique == 1) return;
+    if (p->entropy / 8 + 1 >= (double)n) return;
+    if (n < DICT_ONLY_BLOCK && dict_payload_size(dict, p->freq) < n) return;
+
+    /* the four-stream decoder's fast loop needs every code to fit the table */
+    STAGE_BEGIN(t1);
+    int cap = opt->max_code_len;
+    if (opt->multistream && cap > HUF_TABLE_BITS) cap = HUF_TABLE_BITS;
+    build_code_lengths(p->freq, cap, p->lengths);
+    unsigned char packed[CODE_LENGTHS_MAX];
+    p->table_size = put_code_lengths(packed, p->lengths);
+    p->bits = encoded_bits(p->freq, p->lengths);
+    p->built = 1;
+    st->table_builds++;
+    STAGE_END(st, HUF_STAGE_LENGTHS, t1);
+    if (pairs && n >= CONTEXT_MIN_BLOCK) plan_context(src, n, opt, pairs, &p->context, st);
+}
+
+/*
+ * Pick the smallest coding for block number index from its plan: RLE,
+ * stored, the trained table, its own table, its order-1 tables, or the
+ * previous table again. All of
+ * these are estimated from the histogram alone, so nothing is encoded
+ * twice. Ties go to the earlier candidate.
+ */
+static void choose_block(const BlockPlan *p, size_t n, uint64_t index, const HufOptions *opt,
+                         const HufDict *dict, const PrevTable *prev, BlockChoice *c) {
+    int split = opt->multistream && n >= MULTISTREAM_MIN_BLOCK;
+    size_t best = n;
+    c->type = BLOCK_STORED;
+    if (p->unique == 1) {
+        if (n > 1) c->type = BLOCK_RLE;
+        return;
+    }
+
+    size_t size = dict_payload_size(dict, p->freq);
+    if (size < best) { best = size; c->type = BLOCK_HUFFMAN_DICT; }
+
+    if (p->built) {
+        size = p->table_size + streams_size(p->bits, split);
+        if (split && size < best) { best = size; c->type = BLOCK_HUFFMAN4; }
+        size = p->table_size + streams_size(p->bits, 0);
+        if (c->type != BLOCK_HUFFMAN4 && size < best) { best = size; c->type = BLOCK_HUFFMAN; }
+    }
+    if (p->context.tables && p->context.size < best) { best = p->context.size; c->type = BLOCK_CONTEXT; }
+
+    /* a sampled block may still end up stored (see encode_block), so none is repeated */
+    uint64_t bits = prev->valid && opt->sample < 2 ? reuse_bits(prev->lengths, p->freq) : UINT64_MAX;
+    if (bits != UINT64_MAX && index - prev->block <= UINT32_MAX) {
+        size = REPEAT_BACK_SIZE + streams_size(bits, split);
+        if (size < best) {
+            c->type = split ? BLOCK_REPEAT4 : BLOCK_REPEAT;
+            c->back = (uint32_t)(index - prev->block);
+            memcpy(c->lengths, prev->lengths, 256);
+        }
+    }
+}
+
+/* Count block n bytes coded as c (in stream order, by whoever chose c) */
+static void record_block(HufStats *st, const BlockPlan *p, const BlockChoice *c, size_t n,
+                         const HufDict *dict) {
+    const unsigned char *lengths;
+    st->blocks++;
+    st->bytes_in += n;
+    switch (c->type) {
+    case BLOCK_STORED: st->stored_blocks++; return;
+    case BLOCK_RLE: st->rle_blocks++; return;
+    case BLOCK_HUFFMAN_DICT: st->dict_blocks++; lengths = dict->lengths; break;
+    case BLOCK_REPEAT:
+    case BLOCK_REPEAT4: st->repeat_blocks++; lengths = c->lengths; break;
+    case BLOCK_CONTEXT:
+        st->context_blocks++;
+        st->coded_bytes += n;
+        st->coded_bits += p->context.bits;
+        st->entropy_bits += p->context.entropy;
+        for (int t = 0; t < p->context.tables; ++t)
+            for (int i = 0; i < 256; ++i)
+                if (p->context.lengths[t][i] > st->max_code_len) st->max_code_len = p->context.lengths[t][i];
+        return;
+    default: lengths = p->lengths; break;
+    }
+    st->coded_bytes += n;
+    st->coded_bits += encoded_bits(p->freq, lengths);
+    st->entropy_bits += p->entropy;
+    for (int i = 0; i < 256; ++i)
+        if (p->freq[i] && lengths[i] > st->max_code_len) st->max_code_len = lengths[i];
+}
+
+/* After block index is coded as c: remember its table if a repeat may reuse it */
+static void update_prev_table(PrevTable *prev, const BlockPlan *p, const BlockChoice *c, uint64_t index) {
+    if ((c->type == BLOCK_HUFFMAN || c->type == BLOCK_HUFFMAN4) && p->unique > 1) {
+        prev->valid = 1;
+        prev->block = index;
+        memcpy(prev->lengths, p->lengths, 256);
+    }
+}
+
+/*
+ * Output limits for codings planned from a sample, whose real size is
+ * only known once coded: the encoders below check the room left every
+ * ENCODE_SLICE bytes and give up before a slice could overrun it. A room
+ * of SIZE_MAX is unlimited.
+ */
+#define ENCODE_SLICE 4096
+
+/* room less used bytes, or 0 if they fill it */
+static size_t room_after(size_t room, size_t used) {
+    if (room == SIZE_MAX) return SIZE_MAX;
+    return used < room ? room - used : 0;
+}
+
+/* 1 if a slice of n bytes with codes of up to max_len bits, then finish, keeps bw within room */
+static int slice_fits(const BitWriter *bw, size_t n, int max_len, size_t room) {
+    return room == SIZE_MAX || bw->pos + (n * (size_t)max_len + 7) / 8 + 1 <= room;
+}
+
+/* Encode src[0..n) into bw within room bytes. Returns 0 if it would not fit */
+static int encode_within(BitWriter *bw, const Code codes[256], int max_len, const unsigned char *src, size_t n,
+                         size_t room) {
+    const BitKernels *k = bit_kernels();
+    size_t slice = room == SIZE_MAX ? n : ENCODE_SLICE;
+    for (size_t i = 0; i < n; i += slice) {
+        size_t len = n - i < slice ? n - i : slice;
+        if (!slice_fits(bw, len, max_len, room)) return 0;
+        k->encode(bw, codes, max_len, src + i, len);
+    }
+    return 1;
+}
+
+/* Order-1 encode_within */
+static int encode_context_within(BitWriter *bw, const Code *const by_prev[256], int max_len,
+                                 const unsigned char *src, size_t n, size_t room) {
+    const BitKernels *k = bit_kernels();
+    size_t slice = room == SIZE_MAX ? n : ENCODE_SLICE;
+    for (size_t i = 0; i < n; i += slice) {
+        size_t len = n - i < slice ? n - i : slice;
+        if (!slice_fits(bw, len, max_len, room)) return 0;
+        k->encode_context(bw, by_prev, max_len, src + i, len, i ? src[i - 1] : 0);
+    }
+    return 1;
+}
+
+/*
+ * Code src with lengths as one bitstream, or as a jump table and four
+ * bitstreams over the block's quarters. Returns bytes written, or 0 if
+ * they would not fit in room.
+ */
+static size_t put_bitstreams(unsigned char *dst, const unsigned char *src, size_t n,
+                             const unsigned char lengths[256], int split, size_t room, HufStats *st) {
+    STAGE_BEGIN(t0);
+    Code codes[256];
+    generate_codes(lengths, codes);
+    int max_len = 0;
+    for (int i = 0; i < 256; ++i) if (lengths[i] > max_len) max_len = lengths[i];
+    STAGE_END(st, HUF_STAGE_CODES, t0);
+
+    STAGE_BEGIN(t1);
+    size_t pos;
+    if (!split) {
+        BitWriter bw;
+        bitwriter_init(&bw, dst);
+        pos = encode_within(&bw, codes, max_len, src, n, room) ? bitwriter_finish(&bw) : 0;
+    } else {
+        size_t seg = (n + 3) / 4;
+        pos = JUMP_TABLE_SIZE;
+        for (int k = 0; k < 4 && pos; ++k) {
+            size_t start = k * seg < n ? k * seg : n;
+            size_t len = n - start < seg ? n - start : seg;
+            BitWriter bw;
+            bitwriter_init(&bw, dst + pos);
+            if (!encode_within(&bw, codes, max_len, src + start, len, room_after(room, pos))) {
+                pos = 0;
+                break;
+            }
+            size_t stream_size = bitwriter_finish(&bw);
+            if (k < 3) store_le32(dst + 4 * k, (uint32_t)stream_size);
+            pos += stream_size;
+        }
+    }
+    STAGE_END(st, HUF_STAGE_ENCODE, t1);
+    return pos;
+}
+
+/*
+ * Encode n bytes order-1: each takes its code from by_prev of the byte
+ * before it (by_prev[prev] for the first).
+ */
+KERNEL_INLINE void encode_context_body(BitWriter *bw, const Code *const by_prev[256], int max_len,
+                                       const unsigned char *src, size_t n, unsigned prev) {
+    size_t per_flush = (size_t)(56 / max_len), i = 0;
+    while (i + per_flush <= n) {
+        for (size_t k = 0; k < per_flush; ++k) {
+            const Code *c = &by_prev[prev][src[i + k]];
+            bitwriter_put(bw, c->code, c->len);
+            prev = src[i + k];
+        }
+        bitwriter_flush_bits(bw);
+        i += per_flush;
+    }
+    for (; i < n; ++i) {
+        const Code *c = &by_prev[prev][src[i]];
+        bitwriter_put(bw, c->code, c->len);
+        bitwriter_flush_bits(bw);
+        prev = src[i];
+    }
+}
+
+/*
+ * Write an order-1 payload for src[0..n) as planned in cp: the table
+ * count, the context map, the tables, then one bitstream in which each
+ * byte takes its code from the table of the byte before it. Returns bytes
+ * written, or 0 if they would not fit in room.
+ */
+static size_t put_context_block(unsigned char *dst, const unsigned char *src, size_t n, const ContextPlan *cp,
+                                size_t room, HufStats *st) {
+    STAGE_BEGIN(t0);
+    Code codes[HUF_MAX_CONTEXT_TABLES][256];
+    const Code *by_prev[256];
+    size_t pos = 0;
+    int max_len = 1;
+    dst[pos++] = (unsigned char)cp->tables;
+    for (int i = 0; i < 256; i += 2) dst[pos++] = (unsigned char)(cp->map[i] | cp->map[i + 1] << 4);
+    for (int t = 0; t < cp->tables; ++t) {
+        pos += put_code_lengths(dst + pos, cp->lengths[t]);
+        generate_codes(cp->lengths[t], codes[t]);
+        for (int i = 0; i < 256; ++i) if (cp->lengths[t][i] > max_len) max_len = cp->lengths[t][i];
+    }
+    for (int i = 0; i < 256; ++i) by_prev[i] = codes[cp->map[i]];
+    STAGE_END(st, HUF_STAGE_CODES, t0);
+
+    STAGE_BEGIN(t1);
+    BitWriter bw;
+    bitwriter_init(&bw, dst + pos);
+    if (encode_context_within(&bw, by_prev, max_len, src, n, room_after(room, pos))) pos += bitwriter_finish(&bw);
+    else pos = 0;
+    STAGE_END(st, HUF_STAGE_ENCODE, t1);
+    return pos;
+}
+
+/*
+ * Write block src[0..n) coded as chosen into dst, which must hold
+ * block_bound(n) bytes. A coding planned from a sample (opt->sample) that
+ * turns out no smaller than the block is dropped for a stored block, and
+ * c is updated to match. Returns bytes written.
+ */
+static size_t encode_block(const unsigned char *src, size_t n, const HufOptions *opt, unsigned char *dst,
+                           const BlockPlan *p, BlockChoice *c, const HufDict *dict, HufStats *st) {
+    size_t header_size = block_header_size(n, opt->block_size);
+    unsigned char *payload = dst + header_size;
+    size_t room = opt->sample > 1 ? n - 1 : SIZE_MAX;
+    size_t payload_size, part;
+    switch (c->type) {
+    case BLOCK_HUFFMAN:
+    case BLOCK_HUFFMAN4:
+        payload_size = put_code_lengths(payload, p->lengths);
+        part = put_bitstreams(payload + payload_size, src, n, p->lengths, c->type == BLOCK_HUFFMAN4,
+                              room_after(room, payload_size), st);
+        payload_size = part ? payload_size + part : SIZE_MAX;
+        break;
+    case BLOCK_HUFFMAN_DICT: {
+        STAGE_BEGIN(t0);
+        store_le32(payload, dict->id);
+        BitWriter bw;
+        bitwriter_init(&bw, payload + DICT_ID_SIZE);
+        if (encode_within(&bw, dict->codes, dict->max_len, src, n, room_after(room, DICT_ID_SIZE)))
+            payload_size = DICT_ID_SIZE + bitwriter_finish(&bw);
+        else
+            payload_size = SIZE_MAX;
+        STAGE_END(st, HUF_STAGE_ENCODE, t0);
+        break;
+    }
+    case BLOCK_REPEAT:
+    case BLOCK_REPEAT4:
+        store_le32(payload, c->back);
+        payload_size = REPEAT_BACK_SIZE + put_bitstreams(payload + REPEAT_BACK_SIZE, src, n, c->lengths,
+                                                         c->type == BLOCK_REPEAT4, SIZE_MAX, st);
+        break;
+    case BLOCK_RLE:
+        payload[0] = src[0];
+        payload_size = 1;
+        break;
+    case BLOCK_CONTEXT:
+        part = put_context_block(payload, src, n, &p->context, room, st);
+        payload_size = part ? part : SIZE_MAX;
+        break;
+    default:
+        payload_size = SIZE_MAX;
+        break;
+    }
+    if (payload_size == SIZE_MAX || payload_size > room) {
+        /* stored, as chosen or because the sample misjudged the block */
+        STAGE_BEGIN(t0);
+        c->type = BLOCK_STORED;
+        memcpy(payload, src, n);
+        payload_size = n;
+        STAGE_END(st, HUF_STAGE_ENCODE, t0);
+    }
+    STAGE_BEGIN(t1);
+    BlockHeader h = { c->type, (uint32_t)n, (uint32_t)payload_size, crc32c(src, n) };
+    STAGE_END(st, HUF_STAGE_CHECKSUM, t1);
+    put_block_header(dst, &h, opt->block_size);
+    st->bytes_out += header_size + payload_size;
+    return header_size + payload_size;
+}
+
+/*
+ * Compress block number index of a stream (n bytes, 1..block size) into
+ * dst in one go, for callers that code blocks in order. prev carries the
+ * table a later block may repeat. Returns bytes written.
+ */
+static size_t compress_block(const unsigned char *src, size_t n, unsigned char *dst, uint64_t index,
+                             const HufOptions *opt, const HufDict *dict, uint32_t *pairs, PrevTable *prev,
+                             HufStats *st) {
+    BlockPlan plan;
+    BlockChoice choice;
+    plan_block(src, n, opt, dict, pairs, &plan, st);
+    choose_block(&plan, n, index, opt, dict, prev, &choice);
+    update_prev_table(prev, &plan, &choice, index);
+    size_t size = encode_block(src, n, opt, dst, &plan, &choice, dict, st);
+    record_block(st, &plan, &choice, n, dict);
+    return size;
+}
+
+/*
+ * Decode count symbols into dst. Returns the number decoded, which is
+ * short of count only if the input ends early or holds an invalid code.
+ * While a whole 8-byte refill is still in bounds it leaves at least 56
+ * real bits, so canonical codes are decoded 56 / max_len per refill with
+ * no bounds checks, whatever the input holds; only the last few bytes
+ * take the checked loop.
+ */
+KERNEL_INLINE size_t decode_symbols_body(const DecodeTable *table, BitReader *br, unsigned char *dst, size_t count) {
+    size_t written = 0;
+    if (!table->tree) {
+        size_t per = (size_t)(56 / table->max_len);
+        while (count - written >= per && br->len - br->pos >= 8) {
+            bitreader_refill(br);
+            for (size_t j = 0; j < per; ++j) {
+                uint16_t e = table->entry[bitreader_peek(br, HUF_TABLE_BITS)];
+                int sym = e & 0xFF;
+                if (e >> 8) bitreader_consume(br, e >> 8);
+                else if ((sym = decode_slow_canonical(table, br)) < 0) return written;
+                dst[written++] = (unsigned char)sym;
+            }
+        }
+    }
+    while (written < count) {
+        if (br->bit_count < HUF_TABLE_BITS) bitreader_refill(br);
+        uint16_t e = table->entry[bitreader_peek(br, HUF_TABLE_BITS)];
+        int len = e >> 8;
+        int sym;
+        if (len == 0) {
+            sym = decode_slow(table, br);
+        } else if (len <= br->bit_count) {
+            sym = e & 0xFF;
+            bitreader_consume(br, len);
+        } else {
+            sym = -1; /* code runs past the end of the input */
+        }
+        if (sym < 0) break;
+        dst[written++] = (unsigned char)sym;
+    }
+    return written;
+}
+
+/*
+ * Decode four independent streams, each filling one quarter of dst. While
+ * every stream still has symbols left and no code is longer than the
+ * table, the loop advances all four readers together: one refill each,
+ * then four table lookups per stream with no bounds checks (4 x 11 bits
+ * fits the 57 refilled bits). Overruns can only read zero padding and are
+ * caught afterwards; the tails, and one-symbol codes, use the checked
+ * decoder.
+ */
+KERNEL_INLINE int decode_4streams_body(const DecodeTable *t, BitReader br[4], unsigned char *dst, size_t n) {
+    size_t seg = (n + 3) / 4;
+    unsigned char *out[4];
+    size_t len[4];
+    for (int k = 0; k < 4; ++k) {
+        size_t start = k * seg < n ? k * seg : n;
+        out[k] = dst + start;
+        len[k] = n - start < seg ? n - start : seg;
+    }
+
+    size_t i = 0;
+    if (t->max_len <= HUF_TABLE_BITS && t->complete) {
+#define DECODE_FAST(k) do { \
+            uint16_t e = t->entry[bitreader_peek(&br[k], HUF_TABLE_BITS)]; \
+            bitreader_consume(&br[k], e >> 8); \
+            out[k][i + j] = (unsigned char)e; \
+        } while (0)
+        for (; i + 4 <= len[3]; i += 4) {
+            bitreader_refill(&br[0]);
+            bitreader_refill(&br[1]);
+            bitreader_refill(&br[2]);
+            bitreader_refill(&br[3]);
+            for (int j = 0; j < 4; ++j) {
+                DECODE_FAST(0);
+                DECODE_FAST(1);
+                DECODE_FAST(2);
+                DECODE_FAST(3);
+            }
+        }
+#undef DECODE_FAST
+        for (int k = 0; k < 4; ++k) if (br[k].bit_count < 0) return 0;
+    }
+    for (int k = 0; k < 4; ++k) {
+        if (decode_symbols_body(t, &br[k], out[k] + i, len[k] - i) != len[k] - i) return 0;
+    }
+    return 1;
+}
+
+/* Report a block coded with a trained table that is not loaded; 1 if so */
+static int dict_missing(int type, const unsigned char *payload, size_t payload_size, const HufDict *dict) {
+    if (type != BLOCK_HUFFMAN_DICT || payload_size < DICT_ID_SIZE) return 0;
+    uint32_t id = load_le32(payload);
+    if (dict && dict->id == id) return 0;
+    fprintf(stderr, "Error: block needs trained table %u (load it with a dictionary)\n", id);
+    return 1;
+}
+
+/* Set up bit readers over a jump table and four streams in src[0..n) */
+static int init_4streams(BitReader br[4], const unsigned char *src, size_t n) {
+    if (n < JUMP_TABLE_SIZE) return 0;
+    size_t left = n - JUMP_TABLE_SIZE;
+    const unsigned char *p = src + JUMP_TABLE_SIZE;
+    for (int k = 0; k < 4; ++k) {
+        size_t size = k < 3 ? load_le32(src + 4 * k) : left;
+        if (size > left) return 0;
+        bitreader_init_mem(&br[k], p, size);
+        p += size;
+        left -= size;
+    }
+    return 1;
+}
+
+/* Decode raw_size bytes from one bitstream or four (split) in src[0..n) */
+static int decode_bitstreams(const DecodeTable *table, const unsigned char *src, size_t n,
+                             unsigned char *dst, size_t raw_size, int split) {
+    if (split) {
+        BitReader br[4];
+        return init_4streams(br, src, n) && bit_kernels()->decode4(table, br, dst, raw_size);
+    }
+    BitReader br;
+    bitreader_init_mem(&br, src, n);
+    return bit_kernels()->decode(table, &br, dst, raw_size) == raw_size;
+}
+
+static void block_decoder_init(BlockDecoder *d, DecodeTable *table, DecodeTable *context, const HufDict *dict,
+                               HufStats *stats) {
+    d->table = table;
+    d->context = context;
+    d->table_block = UINT64_MAX;
+    d->block = 0;
+    d->dict = dict;
+    d->stats = stats;
+}
+
+/* Check a decoded block against the CRC32C from its header */
+static int block_crc_ok(BlockDecoder *d, const unsigned char *raw, size_t n, uint32_t expect) {
+    STAGE_BEGIN(t0);
+    int ok = crc32c(raw, n) == expect;
+    STAGE_END(d->stats, HUF_STAGE_CHECKSUM, t0);
+    return ok;
+}
+
+/* Build d->table from lengths for block d->block. Returns 0 if they are invalid */
+static int block_decoder_build(BlockDecoder *d, const unsigned char lengths[256]) {
+    STAGE_BEGIN(t0);
+    d->table_block = UINT64_MAX;
+    int ok = decode_table_build_canonical(d->table, lengths);
+    STAGE_END(d->stats, HUF_STAGE_CODES, t0);
+    d->stats->table_builds++;
+    if (ok) d->table_block = d->block;
+    return ok;
+}
+
+/* Count one decoded block. Returns 1 */
+static int count_decoded(HufStats *st, size_t raw_size) {
+    st->blocks++;
+    st->bytes_out += raw_size;
+    return 1;
+}
+
+/*
+ * Decode count order-1 symbols: each with the table that map picks for
+ * the byte before it (0 for the first). When no code of the tables is
+ * longer than the lookup table (max_len), five symbols are decoded per
+ * refill (5 x 11 bits fit the 56 refilled) with no bounds checks; an
+ * overrun only reads zero padding and is caught after the loop. Returns
+ * the number decoded.
+ */
+KERNEL_INLINE size_t decode_context_body(const DecodeTable *tables, const unsigned char map[256], int max_len,
+                                        BitReader *br, unsigned char *dst, size_t count) {
+    size_t i = 0;
+    unsigned prev = 0;
+    if (max_len <= HUF_TABLE_BITS) {
+        for (; i + 5 <= count; i += 5) {
+            bitreader_refill(br);
+            for (int j = 0; j < 5; ++j) {
+                uint16_t e = tables[map[prev]].entry[bitreader_peek(br, HUF_TABLE_BITS)];
+                bitreader_consume(br, e >> 8);
+                prev = e & 0xFF;
+                dst[i + j] = (unsigned char)prev;
+            }
+        }
+        if (br->bit_count < 0) return 0;
+    } else {
+        /* longer codes: as decode_symbols_body, batches only while a refill stays in bounds */
+        size_t per = (size_t)(56 / max_len);
+        while (count - i >= per && br->len - br->pos >= 8) {
+            bitreader_refill(br);
+            for (size_t j = 0; j < per; ++j) {
+                const DecodeTable *t = &tables[map[prev]];
+                uint16_t e = t->entry[bitreader_peek(br, HUF_TABLE_BITS)];
+                int sym = e & 0xFF;
+                if (e >> 8) bitreader_consume(br, e >> 8);
+                else if ((sym = decode_slow_canonical(t, br)) < 0) return i;
+                dst[i++] = (unsigned char)sym;
+                prev = (unsigned)sym;
+            }
+        }
+    }
+    for (; i < count; ++i) {
+        const DecodeTable *t = &tables[map[prev]];
+        if (br->bit_count < HUF_TABLE_BITS) bitreader_refill(br);
+        uint16_t e = t->entry[bitreader_peek(br, HUF_TABLE_BITS)];
+        int len = e >> 8;
+        int sym;
+        if (len == 0) {
+            sym = decode_slow(t, br);
+        } else if (len <= br->bit_count) {
+            sym = e & 0xFF;
+            bitreader_consume(br, len);
+        } else {
+            sym = -1;
+        }
+        if (sym < 0) break;
+        dst[i] = (unsigned char)sym;
+        prev = (unsigned)sym;
+    }
+    return i;
+}
+
+/* -----------------------------
+   Bit kernels (picked at run time)
+   ----------------------------- */
+
+/*
+ * Each instantiation wraps the loop bodies above in functions built for
+ * one instruction set. With BMI2 (Haswell and Zen onwards) every variable
+ * shift of the bit accumulators becomes a single shlx/shrx instead of a
+ * flag-merging shift by cl, which costs three micro-ops on Haswell and
+ * Skylake. The order of operations is unchanged, so output is identical.
+ * ARM and other hosts use the generic build, whose shifts are already
+ * single instructions there.
+ */
+#define DEFINE_BIT_KERNELS(isa, attr) \
+    attr static void encode_bytes_##isa(BitWriter *bw, const Code codes[256], int max_len, \
+                                        const unsigned char *src, size_t n) { \
+        encode_bytes_body(bw, codes, max_len, src, n); \
+    } \
+    attr static void encode_context_##isa(BitWriter *bw, const Code *const by_prev[256], int max_len, \
+                                          const unsigned char *src, size_t n, unsigned prev) { \
+        encode_context_body(bw, by_prev, max_len, src, n, prev); \
+    } \
+    attr static size_t decode_symbols_##isa(const DecodeTable *table, BitReader *br, unsigned char *dst, \
+                                            size_t count) { \
+        return decode_symbols_body(table, br, dst, count); \
+    } \
+    attr static int decode_4streams_##isa(const DecodeTable *t, BitReader br[4], unsigned char *dst, size_t n) { \
+        return decode_4streams_body(t, br, dst, n); \
+    } \
+    attr static size_t decode_context_##isa(const DecodeTable *tables, const unsigned char map[256], int max_len, \
+                                            BitReader *br, unsigned char *dst, size_t count) { \
+        return decode_context_body(tables, map, max_len, br, dst, count); \
+    } \
+    static const BitKernels bit_kernels_##isa = { \
+        #isa, encode_bytes_##isa, encode_context_##isa, decode_symbols_##isa, decode_4streams_##isa, \
+        decode_context_##isa \
+    };
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_BMI2_KERNELS 1
+#endif
+
+DEFINE_BIT_KERNELS(generic, )
+#ifdef HAVE_BMI2_KERNELS
+DEFINE_BIT_KERNELS(bmi2, __attribute__((target("bmi2"))))
+#endif
+
+static const BitKernels *bit_kernels_active;
+static pthread_once_t bit_kernels_once = PTHREAD_ONCE_INIT;
+
+/* HUF_KERNELS=generic in the environment keeps the portable build, for comparisons */
+static void bit_kernels_init(void) {
+    bit_kernels_active = &bit_kernels_generic;
+#ifdef HAVE_BMI2_KERNELS
+    const char *force = getenv("HUF_KERNELS");
+    if (__builtin_cpu_supports("bmi2") && !(force && strcmp(force, "generic") == 0))
+        bit_kernels_active = &bit_kernels_bmi2;
+#endif
+}
+
+static const BitKernels *bit_kernels(void) {
+    pthread_once(&bit_kernels_once, bit_kernels_init);
+    return bit_kernels_active;
+}
+
+/*
+ * Decode an order-1 block into dst. Its tables are built in d->context,
+ * so d->table, which a later repeat block may need, is left alone.
+ */
+static int decompress_context_block(BlockDecoder *d, const unsigned char *payload, size_t payload_size,
+                                    unsigned char *dst, size_t raw_size) {
+    HufStats *st = d->stats;
+    if (payload_size < 1 + CONTEXT_MAP_SIZE) return 0;
+    int k = payload[0];
+    if (k < 2 || k > HUF_MAX_CONTEXT_TABLES) return 0;
+    unsigned char map[256];
+    for (int i = 0; i < 256; ++i) {
+        map[i] = (payload[1 + i / 2] >> (4 * (i & 1))) & 0x0F;
+        if (map[i] >= k) return 0;
+    }
+
+    STAGE_BEGIN(t0);
+    size_t pos = 1 + CONTEXT_MAP_SIZE;
+    int ok = 1, max_len = 0, complete = 1;
+    for (int t = 0; t < k && ok; ++t) {
+        unsigned char lengths[256];
+        size_t len = get_code_lengths(payload + pos, payload_size - pos, lengths);
+        ok = len != 0 && decode_table_build_canonical(&d->context[t], lengths);
+        pos += len;
+        if (d->context[t].max_len > max_len) max_len = d->context[t].max_len;
+        complete &= d->context[t].complete;
+        st->table_builds++;
+    }
+    STAGE_END(st, HUF_STAGE_CODES, t0);
+    if (!ok) return 0;
+
+    /* a one-symbol table has entries that decode nothing: keep to the loops that check */
+    STAGE_BEGIN(t1);
+    BitReader br;
+    bitreader_init_mem(&br, payload + pos, payload_size - pos);
+    ok = bit_kernels()->decode_context(d->context, map, complete ? max_len : HUF_TABLE_BITS + 1, &br, dst,
+                                       raw_size) == raw_size;
+    STAGE_END(st, HUF_STAGE_DECODE, t1);
+    if (!ok) return 0;
+    st->context_blocks++;
+    st->coded_bytes += raw_size;
+    if (max_len > st->max_code_len) st->max_code_len = max_len;
+    return count_decoded(st, raw_size);
+}
+
+/*
+ * Decode block number d->block, a payload of the given type, into dst
+ * (raw_size bytes). A table-carrying block leaves its table in d->table
+ * for repeat blocks after it. Returns 1 on success, 0 if the payload is
+ * malformed, needs a trained table other than d->dict, or repeats a table
+ * that is not the one in d->table.
+ */
+static int decompress_block(BlockDecoder *d, int type, const unsigned char *payload, size_t payload_size,
+                            unsigned char *dst, size_t raw_size) {
+    HufStats *st = d->stats;
+    const DecodeTable *table;
+    size_t skip;
+    int split = 0;
+    switch (type) {
+    case BLOCK_STORED:
+    case BLOCK_RLE: {
+        if (payload_size != (type == BLOCK_RLE ? 1 : raw_size)) return 0;
+        STAGE_BEGIN(t0);
+        if (type == BLOCK_RLE) memset(dst, payload[0], raw_size);
+        else memcpy(dst, payload, raw_size);
+        STAGE_END(st, HUF_STAGE_DECODE, t0);
+        if (type == BLOCK_RLE) st->rle_blocks++;
+        else st->stored_blocks++;
+        return count_decoded(st, raw_size);
+    }
+    case BLOCK_HUFFMAN_DICT:
+        if (!d->dict || payload_size < DICT_ID_SIZE || load_le32(payload) != d->dict->id) return 0;
+        table = &d->dict->table;
+        skip = DICT_ID_SIZE;
+        st->dict_blocks++;
+        break;
+    case BLOCK_REPEAT:
+    case BLOCK_REPEAT4: {
+        if (payload_size < REPEAT_BACK_SIZE) return 0;
+        uint32_t back = load_le32(payload);
+        if (back == 0 || back > d->block || d->block - back != d->table_block) return 0;
+        table = d->table;
+        skip = REPEAT_BACK_SIZE;
+        split = type == BLOCK_REPEAT4;
+        st->repeat_blocks++;
+        break;
+    }
+    case BLOCK_HUFFMAN:
+    case BLOCK_HUFFMAN4: {
+        unsigned char lengths[256];
+        skip = get_code_lengths(payload, payload_size, lengths);
+        if (skip == 0) return 0;
+
+        int unique = 0; unsigned char onlyChar = 0;
+        for (int i = 0; i < 256; ++i) if (lengths[i] > 0) { unique++; onlyChar = (unsigned char)i; }
+        if (unique == 1) {
+            /* written before BLOCK_RLE existed */
+            memset(dst, onlyChar, raw_size);
+            st->rle_blocks++;
+            return count_decoded(st, raw_size);
+        }
+        if (!block_decoder_build(d, lengths)) return 0;
+        table = d->table;
+        split = type == BLOCK_HUFFMAN4;
+        break;
+    }
+    case BLOCK_CONTEXT:
+        return decompress_context_block(d, payload, payload_size, dst, raw_size);
+    default:
+        return 0;
+    }
+
+    STAGE_BEGIN(t1);
+    int ok = decode_bitstreams(table, payload + skip, payload_size - skip, dst, raw_size, split);
+    STAGE_END(st, HUF_STAGE_DECODE, t1);
+    if (!ok) return 0;
+    st->coded_bytes += raw_size;
+    if (table->max_len > st->max_code_len) st->max_code_len = table->max_len;
+    return count_decoded(st, raw_size);
+}
+
+/* -----------------------------
+   Memory footprint & pipeline slots
+   ----------------------------- */
+
+/*
+ * What a context holds is worked out from its options with the same sums
+ * that size its allocations, so huf_estimate_memory, the memory budget and
+ * HufStats.memory_peak all agree with what is actually allocated.
+ */
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+/* The block buffers of a context (ctx->block, ctx->raw) */
+static size_t block_buffers_bytes(size_t block_size) {
+    return block_bound(block_size) + CODE_LENGTHS_MAX + round_up(block_size, IO_ALIGN);
+}
+
+static size_t pairs_bytes(const HufOptions *opt) {
+    return opt->context_tables ? sizeof(uint32_t) * 256 * 256 : 0;
+}
+
+/* One slot stride: raw block, packed block, then pair counts or decode tables */
+static size_t slot_raw_bytes(size_t block_size) {
+    return round_up(block_size, IO_ALIGN);
+}
+
+static size_t slot_packed_bytes(size_t block_size) {
+    return round_up(block_bound(block_size) + CODE_LENGTHS_MAX, 64);
+}
+
+static size_t slot_bytes(const HufOptions *opt, size_t block_size) {
+    size_t tables = sizeof(DecodeTable) * (1 + HUF_MAX_CONTEXT_TABLES), pairs = pairs_bytes(opt);
+    size_t shared = tables > pairs ? tables : pairs;
+    return round_up(slot_raw_bytes(block_size) + slot_packed_bytes(block_size) + shared, IO_ALIGN);
+}
+
+/* One thread gets three slots (read, code and write overlap), more get two each */
+static size_t pipeline_slots(int threads) {
+    return threads > 1 ? 2 * (size_t)threads : 3;
+}
+
+static size_t pipeline_bytes(const HufOptions *opt, int threads, size_t block_size) {
+    size_t slots = pipeline_slots(threads);
+    size_t n = sizeof(Pipeline) + slots * (sizeof(BlockJob) + sizeof(DecodeJob) + 2 * sizeof(BlockJob *)) +
+               slots * slot_bytes(opt, block_size);
+    if (threads > 1) n += pool_bytes(threads, slots);
+    return n;
+}
+
+/* A context's largest footprint with threads workers: itself, its buffers, a trained table, a pipeline */
+static size_t ctx_bytes(const HufOptions *opt, int threads) {
+    return sizeof(HufCtx) + block_buffers_bytes(opt->block_size) + pairs_bytes(opt) + sizeof(HufDict) +
+           pipeline_bytes(opt, threads, opt->block_size);
+}
+
+/* Worker threads for opt: as asked (0 = one per CPU), then fewer until the memory budget holds */
+static int ctx_threads(const HufOptions *opt) {
+    int threads = opt->threads > 0 ? opt->threads : cpu_count();
+    while (opt->memory_budget && threads > 1 && ctx_bytes(opt, threads) > opt->memory_budget) threads--;
+    return threads;
+}
+
+static Pipeline *pipeline_create(const HufOptions *opt, int threads, size_t block_size) {
+    Pipeline *p = xmalloc(sizeof(Pipeline));
+    size_t slots = pipeline_slots(threads), stride = slot_bytes(opt, block_size);
+    size_t raw = slot_raw_bytes(block_size), packed = slot_packed_bytes(block_size);
+    p->slots = slots;
+    p->block_size = block_size;
+    p->jobs = xmalloc(sizeof(BlockJob) * slots);
+    p->decode_jobs = xmalloc(sizeof(DecodeJob) * slots);
+    p->rings = xmalloc(sizeof(BlockJob *) * 2 * slots);
+    p->mem = xmalloc_aligned(slots * stride);
+    memset(p->jobs, 0, sizeof(BlockJob) * slots);
+    memset(p->decode_jobs, 0, sizeof(DecodeJob) * slots);
+    for (size_t i = 0; i < slots; ++i) {
+        unsigned char *slot = p->mem + i * stride;
+        p->jobs[i].inbuf = slot;
+        p->jobs[i].out = slot + raw;
+        p->jobs[i].pairs = opt->context_tables ? (uint32_t *)(void *)(slot + raw + packed) : NULL;
+        p->decode_jobs[i].raw = slot;
+        p->decode_jobs[i].cbuf = slot + raw;
+        p->decode_jobs[i].cap = block_bound(block_size) + CODE_LENGTHS_MAX;
+        p->decode_jobs[i].table = (DecodeTable *)(void *)(slot + raw + packed);
+        p->decode_jobs[i].context = p->decode_jobs[i].table + 1;
+    }
+    p->pool = threads > 1 ? pool_create(threads, slots) : NULL;
+    p->bytes = pipeline_bytes(opt, threads, block_size);
+    return p;
+}
+
+static void pipeline_free(Pipeline *p) {
+    if (!p) return;
+    pool_destroy(p->pool);
+    free(p->jobs);
+    free(p->decode_jobs);
+    free(p->rings);
+    free(p->mem);
+    free(p);
+}
+
+/* 1 if ctx may decode blocks of block_size bytes: always, unless they outgrow a budgeted context */
+static int ctx_fits_blocks(const HufCtx *ctx, size_t block_size) {
+    if (!ctx->opt.memory_budget || block_size <= ctx->block_cap) return 1;
+    fprintf(stderr, "Error: stream has %zu-byte blocks; the memory budget was set for %zu\n",
+            block_size, ctx->block_cap);
+    return 0;
+}
+
+/*
+ * The pipeline for a file call with blocks of up to block_size bytes: the
+ * context's own under a memory budget, else a new one. Returns NULL if the
+ * blocks do not fit the budget. Hand it back with pipeline_release.
+ */
+static Pipeline *pipeline_acquire(HufCtx *ctx, int threads, size_t block_size) {
+    if (ctx->pipeline) return ctx_fits_blocks(ctx, block_size) ? ctx->pipeline : NULL;
+    return pipeline_create(&ctx->opt, threads, block_size);
+}
+
+static void pipeline_release(HufCtx *ctx, Pipeline *p) {
+    if (p != ctx->pipeline) pipeline_free(p);
+}
+
+/* Clear the counters for a new call, whose memory peak starts at what ctx holds */
+static void stats_reset(HufCtx *ctx) {
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->stats.memory_peak = ctx->held;
+}
+
+/* Raise the call's memory_peak to what ctx holds plus extra bytes the call has allocated */
+static void note_memory(HufCtx *ctx, Pipeline *p, size_t extra) {
+    uint64_t held = (uint64_t)ctx->held + extra + (p && p != ctx->pipeline ? p->bytes : 0);
+    if (held > ctx->stats.memory_peak) ctx->stats.memory_peak = held;
+}
+
+/* -----------------------------
+   Parallel decompression (block index + pwrite)
+   ----------------------------- */
+
+#ifdef HAVE_MMAP
+/* pread/pwrite until done; return 1 if all n bytes were transferred */
+static int pread_full(int fd, unsigned char *buf, size_t n, uint64_t off) {
+    while (n > 0) {
+        ssize_t r = pread(fd, buf, n, (off_t)off);
+        if (r <= 0) return 0;
+        buf += r; n -= (size_t)r; off += (uint64_t)r;
+    }
+    return 1;
+}
+
+static int pwrite_full(int fd, const unsigned char *buf, size_t n, uint64_t off) {
+    while (n > 0) {
+        ssize_t r = pwrite(fd, buf, n, (off_t)off);
+        if (r <= 0) return 0;
+        buf += r; n -= (size_t)r; off += (uint64_t)r;
+    }
+    return 1;
+}
+
+/*
+ * Load the block index from the end of the block stream, the first
+ * file_size bytes of fd. Checks the trailer magic, the index checksum, the
+ * end block and that the entries tile both the compressed and the
+ * uncompressed ranges. Returns 1 on
+ * success, 0 if the file has no usable index. *entries is malloc'd with
+ * one extra entry at the end block, so entry i + 1 bounds block i; *heap
+ * is what it and the raw index took together.
+ */
+static int read_block_index(int fd, uint64_t file_size, const FrameInfo *f, BlockIndexEntry **entries,
+                            uint64_t *count, uint64_t *total, uint32_t *crc, size_t *heap) {
+    unsigned char trailer[INDEX_TRAILER_SIZE];
+    size_t end_size = f->end_size;
+    if (!(f->features & FEATURE_INDEX) || file_size < f->header_size + end_size + INDEX_TRAILER_SIZE) return 0;
+    if (!pread_full(fd, trailer, INDEX_TRAILER_SIZE, file_size - INDEX_TRAILER_SIZE)) return 0;
+    if (memcmp(trailer + 12, HUF_INDEX_MAGIC, 4) != 0) return 0;
+    uint64_t index_bytes = index_size(f, load_le64(trailer));
+    if (index_bytes > file_size - f->header_size - end_size - INDEX_TRAILER_SIZE) return 0;
+
+    uint64_t end_start = file_size - INDEX_TRAILER_SIZE - index_bytes - end_size;
+    unsigned char *raw = xmalloc((size_t)index_bytes + end_size);
+    if (!pread_full(fd, raw, (size_t)index_bytes + end_size, end_start) ||
+        raw[0] != BLOCK_END ||
+        crc32c(raw + end_size, (size_t)index_bytes) != load_le32(trailer + 8)) {
+        free(raw);
+        return 0;
+    }
+    *total = load_le64(raw + 1);
+    *crc = (f->features & FEATURE_STREAM_CRC) ? load_le32(raw + 9) : 0;
+
+    /* every varint ends in exactly one byte below 0x80, two per entry */
+    const unsigned char *p = raw + end_size;
+    uint64_t n = 0;
+    if (f->version >= 4) {
+        for (uint64_t i = 0; i < index_bytes; ++i) n += p[i] < 0x80;
+        n /= 2;
+    } else {
+        n = index_bytes / INDEX_ENTRY_V3;
+    }
+    BlockIndexEntry *e = xmalloc(sizeof(BlockIndexEntry) * (n + 1));
+    uint64_t raw_offset = 0, offset = f->header_size;
+    size_t pos = 0;
+    int ok = 1;
+    for (uint64_t i = 0; i < n && ok; ++i) {
+        if (f->version >= 4) {
+            uint32_t size;
+            size_t len = get_varint(p + pos, (size_t)index_bytes - pos, &size);
+            size_t len2 = len ? get_varint(p + pos + len, (size_t)index_bytes - pos - len, &e[i].raw_size) : 0;
+            if (len2 == 0 || size < 9 || size > end_start - offset) { ok = 0; break; }
+            pos += len + len2;
+            e[i].offset = offset;
+            offset += size;
+        } else {
+            e[i].offset = load_le64(p + i * INDEX_ENTRY_V3);
+            e[i].raw_size = load_le32(p + i * INDEX_ENTRY_V3 + 8);
+            uint64_t expect = i == 0 ? f->header_size : e[i - 1].offset + BLOCK_HEADER_V3;
+            if (e[i].offset < expect) ok = 0;
+        }
+        e[i].raw_offset = raw_offset;
+        raw_offset += e[i].raw_size;
+        if (e[i].raw_size == 0 || e[i].raw_size > f->block_size) ok = 0;
+    }
+    if (f->version >= 4 && (pos != index_bytes || offset != end_start)) ok = 0;
+    if (f->version < 4 && n > 0 && e[n - 1].offset + BLOCK_HEADER_V3 > end_start) ok = 0;
+    if (raw_offset != *total) ok = 0;
+    e[n].offset = end_start;
+    e[n].raw_offset = raw_offset;
+    e[n].raw_size = 0;
+    free(raw);
+    if (!ok) { free(e); return 0; }
+    *entries = e;
+    *count = n;
+    *heap = (size_t)index_bytes + end_size + sizeof(BlockIndexEntry) * (n + 1);
+    return 1;
+}
+
+/*
+ * A repeat block decoded out of order first needs the table it reuses:
+ * read just the header and code lengths of the block that carries it.
+ * The table stays in the job slot, so a run of repeats builds it once
+ * per slot. Returns 0 if that block holds no usable table.
+ */
+static int load_repeated_table(DecodeJob *job, const unsigned char *payload, size_t payload_size) {
+    if (payload_size < REPEAT_BACK_SIZE) return 0;
+    uint32_t back = load_le32(payload);
+    if (back == 0 || back > job->block) return 0;
+    uint64_t src = job->block - back;
+    if (job->table_block == src) return 1;
+
+    const BlockIndexEntry *e = &job->entries[src];
+    unsigned char buf[BLOCK_HEADER_MAX + CODE_LENGTHS_MAX];
+    uint64_t extent = job->entries[src + 1].offset - e->offset;
+    size_t want = extent < sizeof(buf) ? (size_t)extent : sizeof(buf);
+    unsigned char lengths[256];
+    BlockHeader h;
+    size_t len = 0;
+    if (!pread_full(job->in_fd, buf, want, e->offset) || (len = parse_block_header(job->frame, buf, want, &h)) == 0 ||
+        (h.type != BLOCK_HUFFMAN && h.type != BLOCK_HUFFMAN4) ||
+        get_code_lengths(buf + len, want - len, lengths) == 0) return 0;
+    int unique = 0;
+    for (int i = 0; i < 256; ++i) if (lengths[i]) unique++;
+    if (unique < 2) return 0;
+    BlockDecoder d;
+    block_decoder_init(&d, job->table, job->context, job->dict, &job->stats);
+    d.block = src;
+    int ok = block_decoder_build(&d, lengths);
+    job->table_block = d.table_block;
+    return ok;
+}
+
+/*
+ * Open path through its block index. Returns 1 on success, 0 if it is not
+ * a regular file holding a block stream with a usable index.
+ */
+static int indexed_open(const char *path, IndexedFile *x) {
+    x->fd = open(path, O_RDONLY);
+    if (x->fd < 0) return 0;
+    struct stat st;
+    unsigned char header[FILE_HEADER_MAX];
+    int ok = fstat(x->fd, &st) == 0 && S_ISREG(st.st_mode);
+    size_t head = ok && (uint64_t)st.st_size < sizeof(header) ? (size_t)st.st_size : sizeof(header);
+    ok = ok && pread_full(x->fd, header, head, 0) && parse_file_header(header, head, &x->frame) != 0;
+    x->file_size = ok ? (uint64_t)st.st_size : 0;
+    x->stream_size = x->file_size;
+    if (ok && (x->frame.features & FEATURE_DIRECTORY)) {
+        unsigned char tail[DIRECTORY_TRAILER_SIZE];
+        ok = x->file_size >= DIRECTORY_TRAILER_SIZE &&
+             pread_full(x->fd, tail, DIRECTORY_TRAILER_SIZE, x->file_size - DIRECTORY_TRAILER_SIZE) &&
+             (x->stream_size = block_stream_size(&x->frame, tail, x->file_size)) != 0;
+    }
+    if (!ok || !read_block_index(x->fd, x->stream_size, &x->frame, &x->entries, &x->count, &x->total, &x->crc,
+                              &x->heap)) {
+        close(x->fd);
+        return 0;
+    }
+    return 1;
+}
+
+static void indexed_close(IndexedFile *x) {
+    free(x->entries);
+    close(x->fd);
+}
+
+/* pread indexed block job->block, decode it into job->raw and check its CRC. Returns 1 on success */
+static int decode_indexed_block(DecodeJob *job) {
+    const BlockIndexEntry *e = &job->entries[job->block];
+    uint64_t extent = e[1].offset - e->offset;
+    BlockHeader h;
+    size_t len = 0;
+    int ok = extent <= job->cap && pread_full(job->in_fd, job->cbuf, (size_t)extent, e->offset) &&
+             (len = parse_block_header(job->frame, job->cbuf, (size_t)extent, &h)) != 0;
+    if (!ok) {
+        fprintf(stderr, "Error: corrupt block at byte %llu\n", (unsigned long long)e->raw_offset);
+        return 0;
+    }
+    const unsigned char *payload = job->cbuf + len;
+    size_t payload_size = (size_t)extent - len;
+    BlockDecoder d;
+    block_decoder_init(&d, job->table, job->context, job->dict, &job->stats);
+    d.block = job->block;
+    if ((h.type == BLOCK_REPEAT || h.type == BLOCK_REPEAT4) && !load_repeated_table(job, payload, payload_size))
+        ok = 0;
+    d.table_block = job->table_block;
+    ok = ok && h.raw_size == e->raw_size && h.payload_size == payload_size &&
+         decompress_block(&d, h.type, payload, payload_size, job->raw, e->raw_size) &&
+         block_crc_ok(&d, job->raw, e->raw_size, h.crc);
+    job->table_block = d.table_block;
+    job->crc = h.crc;
+    if (!ok && !dict_missing(h.type, payload, payload_size, job->dict))
+        fprintf(stderr, "Error: corrupt block at byte %llu\n", (unsigned long long)e->raw_offset);
+    return ok;
+}
+
+/* Pool task: decode one indexed block and pwrite it into its slice of the output */
+static void decode_block_task(void *arg) {
+    DecodeJob *job = arg;
+    const BlockIndexEntry *e = &job->entries[job->block];
+    int ok = decode_indexed_block(job);
+    if (ok && job->out_fd >= 0 && !pwrite_full(job->out_fd, job->raw, e->raw_size, e->raw_offset)) {
+        fprintf(stderr, "Error writing output\n");
+        ok = 0;
+    }
+    pthread_mutex_lock(&job->sync->mu);
+    job->ok = ok;
+    job->done = 1;
+    pthread_cond_broadcast(&job->sync->cv);
+    pthread_mutex_unlock(&job->sync->mu);
+}
+
+/*
+ * Decompress a block stream file with its block index, handing blocks to
+ * worker threads that write straight into their slice of the output
+ * (output_path NULL: only check the file). Returns 1 on success, 0 on
+ * failure, -1 if the file cannot be decoded this way (not a regular file
+ * or no index) and the caller should stream.
+ */
+static int decompress_parallel(HufCtx *ctx, const char *input_path, const char *output_path, int threads) {
+    IndexedFile x;
+    if (!indexed_open(input_path, &x)) return -1;
+    uint32_t block_size = x.frame.block_size;
+    BlockIndexEntry *entries = x.entries;
+    uint64_t count = x.count;
+    HufStats *stats = &ctx->stats;
+    Pipeline *pipe = pipeline_acquire(ctx, threads, block_size);
+    if (!pipe) {
+        indexed_close(&x);
+        return 0;
+    }
+
+    int ok = 1, out_fd = -1;
+    if (output_path) {
+        out_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            fprintf(stderr, "Error: cannot open output file '%s'\n", output_path);
+            pipeline_release(ctx, pipe);
+            indexed_close(&x);
+            return 0;
+        }
+        ok = ftruncate(out_fd, (off_t)x.total) == 0;
+        if (!ok) fprintf(stderr, "Error: cannot size output file '%s'\n", output_path);
+    }
+
+    /* same bounded in-flight scheme as the compressor, in the same slots */
+    size_t inflight = pipe->slots;
+    uint32_t content_crc = 0;
+    DecodeJob *jobs = pipe->decode_jobs;
+    JobSync sync;
+    pthread_mutex_init(&sync.mu, NULL);
+    pthread_cond_init(&sync.cv, NULL);
+    for (size_t i = 0; i < inflight; ++i) {
+        jobs[i].in_fd = x.fd;
+        jobs[i].out_fd = out_fd;
+        jobs[i].table_block = UINT64_MAX;
+        jobs[i].frame = &x.frame;
+        jobs[i].entries = entries;
+        jobs[i].dict = ctx->dict;
+        jobs[i].sync = &sync;
+    }
+    ThreadPool *pool = pipe->pool;
+
+    uint64_t next_submit = 0, next_done = 0;
+    while (next_done < count) {
+        while (ok && next_submit < count && next_submit - next_done < inflight) {
+            DecodeJob *job = &jobs[next_submit % inflight];
+            job->block = next_submit;
+            memset(&job->stats, 0, sizeof(job->stats));
+            job->done = 0;
+            pool_submit(pool, decode_block_task, job);
+            next_submit++;
+        }
+        if (next_done == next_submit) break;
+        DecodeJob *job = &jobs[next_done % inflight];
+        pthread_mutex_lock(&sync.mu);
+        while (!job->done) pthread_cond_wait(&sync.cv, &sync.mu);
+        pthread_mutex_unlock(&sync.mu);
+        if (!job->ok) ok = 0;
+        content_crc = crc32c_combine(content_crc, job->crc, entries[next_done].raw_size);
+        stats_add(stats, &job->stats);
+        next_done++;
+    }
+    stats->bytes_in = x.file_size;
+    if (ok && (x.frame.features & FEATURE_STREAM_CRC) && content_crc != x.crc) {
+        fprintf(stderr, "Error: checksum mismatch over the whole stream\n");
+        ok = 0;
+    }
+
+    note_memory(ctx, pipe, x.heap);
+    pipeline_release(ctx, pipe);
+    pthread_mutex_destroy(&sync.mu);
+    pthread_cond_destroy(&sync.cv);
+    indexed_close(&x);
+    if (out_fd >= 0 && close(out_fd) != 0) ok = 0;
+    return ok;
+}
+#endif /* HAVE_MMAP */
+
+/* -----------------------------
+   Context & in-memory API
+   ----------------------------- */
+
+void huf_options_init(HufOptions *opt) {
+    opt->max_code_len = HUF_DEFAULT_MAX_CODE_LEN;
+    opt->block_size = HUF_DEFAULT_BLOCK_SIZE;
+    opt->threads = 0;
+    opt->multistream = 0;
+    opt->direct_io = 0;
+    opt->context_tables = 0;
+    opt->sample = 0;
+    opt->memory_budget = 0;
+}
+
+static int options_valid(const HufOptions *opt) {
+    if (opt->max_code_len < 1 || opt->max_code_len > HUF_MAX_CODE_LEN) {
+        fprintf(stderr, "Error: maximum code length must be 1..%d bits\n", HUF_MAX_CODE_LEN);
+        return 0;
+    }
+    if (opt->block_size < HUF_MIN_BLOCK_SIZE || opt->block_size > HUF_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Error: block size must be %u..%u bytes\n", HUF_MIN_BLOCK_SIZE, HUF_MAX_BLOCK_SIZE);
+        return 0;
+    }
+    if (opt->threads < 0 || opt->threads > HUF_MAX_THREADS) {
+        fprintf(stderr, "Error: thread count must be 0..%d\n", HUF_MAX_THREADS);
+        return 0;
+    }
+    if (opt->context_tables != 0 && (opt->context_tables < 2 || opt->context_tables > HUF_MAX_CONTEXT_TABLES)) {
+        fprintf(stderr, "Error: order-1 table count must be 0 or 2..%d\n", HUF_MAX_CONTEXT_TABLES);
+        return 0;
+    }
+    if (opt->sample < 0 || opt->sample > HUF_MAX_SAMPLE) {
+        fprintf(stderr, "Error: sample rate must be 0..%d\n", HUF_MAX_SAMPLE);
+        return 0;
+    }
+    return 1;
+}
+
+/* Make the block buffers hold blocks of block_size bytes. Returns 0 if a memory budget forbids it */
+static int ctx_reserve(HufCtx *ctx, size_t block_size) {
+    if (block_size <= ctx->block_cap) return 1;
+    if (ctx->block_cap && !ctx_fits_blocks(ctx, block_size)) return 0;
+    free(ctx->block);
+    free(ctx->raw);
+    ctx->block = xmalloc(block_bound(block_size) + CODE_LENGTHS_MAX);
+    ctx->raw = xmalloc_aligned(block_size);
+    ctx->held += block_buffers_bytes(block_size) - (ctx->block_cap ? block_buffers_bytes(ctx->block_cap) : 0);
+    ctx->block_cap = block_size;
+    return 1;
+}
+
+size_t huf_estimate_memory(const HufOptions *opt) {
+    HufOptions defaults;
+    if (!opt) {
+        huf_options_init(&defaults);
+        opt = &defaults;
+    }
+    if (!options_valid(opt)) return 0;
+    return ctx_bytes(opt, ctx_threads(opt));
+}
+
+HufCtx *huf_ctx_create(const HufOptions *opt) {
+    HufOptions defaults;
+    if (!opt) {
+        huf_options_init(&defaults);
+        opt = &defaults;
+    }
+    if (!options_valid(opt)) return NULL;
+    int threads = ctx_threads(opt);
+    if (opt->memory_budget && ctx_bytes(opt, threads) > opt->memory_budget) {
+        fprintf(stderr, "Error: a memory budget of %zu bytes is under the %zu one thread needs with %zu-byte blocks\n",
+                opt->memory_budget, ctx_bytes(opt, 1), opt->block_size);
+        return NULL;
+    }
+    HufCtx *ctx = xmalloc(sizeof(HufCtx));
+    ctx->opt = *opt;
+    ctx->block = ctx->raw = NULL;
+    ctx->block_cap = 0;
+    ctx->dict = ctx->dict_mem = NULL;
+    ctx->pipeline = NULL;
+    ctx->held = sizeof(HufCtx) + pairs_bytes(opt);
+    ctx->pairs = opt->context_tables ? xmalloc(sizeof(uint32_t) * 256 * 256) : NULL;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx_reserve(ctx, opt->block_size);
+    if (opt->memory_budget) {
+        /* everything up front: the file functions then only add the block index */
+        ctx->opt.threads = threads;
+        ctx->dict_mem = xmalloc(sizeof(HufDict));
+        ctx->pipeline = pipeline_create(&ctx->opt, threads, opt->block_size);
+        ctx->held += sizeof(HufDict) + ctx->pipeline->bytes;
+    }
+    return ctx;
+}
+
+void huf_ctx_free(HufCtx *ctx) {
+    if (!ctx) return;
+    pipeline_free(ctx->pipeline);
+    free(ctx->block);
+    free(ctx->raw);
+    free(ctx->pairs);
+    free(ctx->dict_mem);
+    free(ctx);
+}
+
+size_t huf_dict_build(const uint64_t freq[256], int max_code_len, uint32_t id, void *dst, size_t dst_cap) {
+    if (max_code_len < 1 || max_code_len > HUF_MAX_CODE_LEN || dst_cap < HUF_DICT_MAX_SIZE) return HUF_ERROR;
+    /* every byte gets a code so that any record can use the table */
+    uint64_t f[256];
+    for (int i = 0; i < 256; ++i) f[i] = freq[i] + 1;
+    unsigned char lengths[256];
+    build_code_lengths(f, max_code_len, lengths);
+
+    unsigned char *out = dst;
+    memcpy(out, HUF_DICT_MAGIC, 4);
+    size_t n = 8 + put_code_lengths(out + 8, lengths);
+    if (id == 0) id = crc32c(out + 8, n - 8);
+    if (id == 0) id = 1;
+    store_le32(out + 4, id);
+    store_le32(out + n, crc32c(out, n));
+    return n + 4;
+}
+
+int huf_ctx_load_dict(HufCtx *ctx, const void *dict, size_t len) {
+    const unsigned char *in = dict;
+    unsigned char lengths[256];
+    if (len < 12 || len > HUF_DICT_MAX_SIZE || memcmp(in, HUF_DICT_MAGIC, 4) != 0 ||
+        crc32c(in, len - 4) != load_le32(in + len - 4) ||
+        get_code_lengths(in + 8, len - 12, lengths) != len - 12) return 0;
+    for (int i = 0; i < 256; ++i) if (!lengths[i]) return 0;
+    uint32_t id = load_le32(in + 4);
+    /* the same table again: already built */
+    if (ctx->dict && ctx->dict->id == id && memcmp(ctx->dict->lengths, lengths, 256) == 0) return 1;
+
+    DecodeTable table;
+    if (!decode_table_build_canonical(&table, lengths)) return 0;
+    if (!ctx->dict_mem) {
+        ctx->dict_mem = xmalloc(sizeof(HufDict));
+        ctx->held += sizeof(HufDict);
+    }
+    HufDict *d = ctx->dict_mem;
+    d->table = table;
+    d->id = id;
+    memcpy(d->lengths, lengths, 256);
+    generate_codes(lengths, d->codes);
+    d->max_len = d->table.max_len;
+    ctx->dict = d;
+    return 1;
+}
+
+uint32_t huf_ctx_dict_id(const HufCtx *ctx) {
+    return ctx->dict ? ctx->dict->id : 0;
+}
+
+void huf_ctx_stats(const HufCtx *ctx, HufStats *stats) {
+    *stats = ctx->stats;
+}
+
+const char *huf_kernel_name(void) {
+    return bit_kernels()->name;
+}
+
+const char *huf_stage_name(int stage) {
+    static const char *const names[HUF_STAGE_COUNT] = {
+        "histogram", "lengths", "codes", "encode", "decode", "checksum"
+    };
+    return (stage >= 0 && stage < HUF_STAGE_COUNT) ? names[stage] : "?";
+}
+
+size_t huf_compress_bound(size_t src_len) {
+    /* the smallest block size has the most per-block overhead */
+    size_t blocks = (src_len + HUF_MIN_BLOCK_SIZE - 1) / HUF_MIN_BLOCK_SIZE;
+    return FILE_HEADER_MAX + src_len + blocks * (BLOCK_HEADER_MAX + INDEX_ENTRY_MAX) +
+           END_BLOCK_SIZE + INDEX_TRAILER_SIZE;
+}
+
+size_t huf_compress(HufCtx *ctx, const void *src, size_t src_len, void *dst, size_t dst_cap) {
+    const unsigned char *in = src;
+    unsigned char *out = dst;
+    size_t block_size = ctx->opt.block_size;
+    stats_reset(ctx);
+    unsigned char header[FILE_HEADER_MAX];
+    FrameInfo f;
+    size_t header_size = put_file_header(header, (uint32_t)block_size, stream_features(&ctx->opt));
+    parse_file_header(header, header_size, &f);
+    if (dst_cap < header_size) return HUF_ERROR;
+    memcpy(out, header, header_size);
+
+    size_t pos = header_size, blocks = 0;
+    uint32_t crc = 0;
+    PrevTable prev;
+    prev.valid = 0;
+    for (size_t off = 0; off < src_len; off += block_size, blocks++) {
+        size_t n = src_len - off < block_size ? src_len - off : block_size;
+        size_t size;
+        if (dst_cap - pos >= block_bound(n)) {
+            size = compress_block(in + off, n, out + pos, blocks, &ctx->opt, ctx->dict, ctx->pairs, &prev,
+                                  &ctx->stats);
+        } else {
+            /* too close to the end of dst for the bit writer's slack */
+            size = compress_block(in + off, n, ctx->block, blocks, &ctx->opt, ctx->dict, ctx->pairs, &prev,
+                                  &ctx->stats);
+            if (size > dst_cap - pos) return HUF_ERROR;
+            memcpy(out + pos, ctx->block, size);
+        }
+        BlockHeader h;
+        parse_block_header(&f, out + pos, size, &h);
+        crc = crc32c_combine(crc, h.crc, n);
+        pos += size;
+    }
+
+    if (dst_cap - pos < END_BLOCK_SIZE) return HUF_ERROR;
+    put_end_block(out + pos, src_len, crc);
+    /* the index is rebuilt from the block headers just written */
+    unsigned char *index = out + pos + END_BLOCK_SIZE;
+    size_t room = dst_cap - pos - END_BLOCK_SIZE, index_bytes = 0;
+    for (size_t i = 0, off = header_size; i < blocks; ++i) {
+        BlockHeader h;
+        size_t len = parse_block_header(&f, out + off, pos - off, &h);
+        if (room - index_bytes < INDEX_ENTRY_MAX) return HUF_ERROR;
+        index_bytes += put_index_entry(index + index_bytes, len + h.payload_size, h.raw_size);
+        off += len + h.payload_size;
+    }
+    if (room - index_bytes < INDEX_TRAILER_SIZE) return HUF_ERROR;
+    put_index_trailer(index + index_bytes, index, index_bytes);
+    pos += END_BLOCK_SIZE + index_bytes + INDEX_TRAILER_SIZE;
+    ctx->stats.bytes_out = pos;
+    return pos;
+}
+
+size_t huf_decompress(HufCtx *ctx, const void *src, size_t src_len, void *dst, size_t dst_cap) {
+    const unsigned char *in = src;
+    unsigned char *out = dst;
+    stats_reset(ctx);
+    FrameInfo f;
+    if (parse_file_header(in, src_len, &f) == 0) return HUF_ERROR;
+
+    size_t pos = f.header_size, written = 0;
+    uint32_t crc = 0;
+    BlockDecoder d;
+    block_decoder_init(&d, &ctx->table, ctx->context, ctx->dict, &ctx->stats);
+    for (;; d.block++) {
+        if (pos >= src_len) return HUF_ERROR;
+        if (in[pos] == BLOCK_END) {
+            if (src_len - pos < f.end_size || load_le64(in + pos + 1) != written ||
+                ((f.features & FEATURE_STREAM_CRC) && load_le32(in + pos + 9) != crc)) return HUF_ERROR;
+            ctx->stats.bytes_in = src_len;
+            return written;
+        }
+        BlockHeader h;
+        size_t len = parse_block_header(&f, in + pos, src_len - pos, &h);
+        if (len == 0 || h.raw_size > dst_cap - written || h.payload_size > src_len - pos - len) return HUF_ERROR;
+        if (!decompress_block(&d, h.type, in + pos + len, h.payload_size, out + written, h.raw_size) ||
+            !block_crc_ok(&d, out + written, h.raw_size, h.crc)) return HUF_ERROR;
+        crc = crc32c_combine(crc, h.crc, h.raw_size);
+        written += h.raw_size;
+        pos += len + h.payload_size;
+    }
+}
+
+uint64_t huf_content_size(const void *src, size_t src_len) {
+    const unsigned char *in = src;
+    FrameInfo f;
+    if (parse_file_header(in, src_len, &f) == 0) return UINT64_MAX;
+    const unsigned char *tail = src_len >= DIRECTORY_TRAILER_SIZE ? in + src_len - DIRECTORY_TRAILER_SIZE : in;
+    src_len = (size_t)block_stream_size(&f, tail, src_len);
+    if (!(f.features & FEATURE_INDEX) || src_len < f.header_size + f.end_size + INDEX_TRAILER_SIZE) return UINT64_MAX;
+    const unsigned char *trailer = in + src_len - INDEX_TRAILER_SIZE;
+    if (memcmp(trailer + 12, HUF_INDEX_MAGIC, 4) != 0) return UINT64_MAX;
+    uint64_t index_bytes = index_size(&f, load_le64(trailer));
+    if (index_bytes > src_len - f.header_size - f.end_size - INDEX_TRAILER_SIZE) return UINT64_MAX;
+    const unsigned char *end = trailer - index_bytes - f.end_size;
+    if (end[0] != BLOCK_END) return UINT64_MAX;
+    return load_le64(end + 1);
+}
+
+void huf_count_frequencies(const void *src, size_t n, uint64_t freq[256]) {
+    count_frequencies(src, n, freq);
+}
+
+/* "Unlimited" stops at HUF_MAX_CODE_LEN: plain Huffman on skewed 64-bit counts can go far past it */
+int huf_code_lengths(const uint64_t freq[256], int max_len, unsigned char lengths[256]) {
+    if (max_len <= 0 || max_len > HUF_MAX_CODE_LEN) max_len = HUF_MAX_CODE_LEN;
+    return build_code_lengths(freq, max_len, lengths);
+}
+
+void huf_canonical_codes(const unsigned char lengths[256], uint32_t codes[256]) {
+    Code c[256];
+    for (int i = 0; i < 256; ++i) {
+        if (lengths[i] > HUF_MAX_CODE_LEN) {
+            memset(codes, 0, sizeof(uint32_t) * 256);
+            return;
+        }
+    }
+    generate_codes(lengths, c);
+    for (int i = 0; i < 256; ++i) codes[i] = c[i].code;
+}
+
+/* -----------------------------
+   Overlapped block I/O (io_uring or I/O threads)
+   ----------------------------- */
+
+static void set_job_stage(BlockJob *job, int stage) {
+    pthread_mutex_lock(&job->sync->mu);
+    job->stage = stage;
+    pthread_cond_broadcast(&job->sync->cv);
+    pthread_mutex_unlock(&job->sync->mu);
+}
+
+/* Finish job's read or write. Caller holds sync->mu */
+static void aio_finish_locked(AsyncIo *io, BlockJob *job, int stage) {
+    job->stage = stage;
+    io->pending--;
+    pthread_cond_broadcast(&io->sync->cv);
+}
+
+/* Reader thread: fill queued jobs from the input view, in order */
+static void *aio_reader(void *arg) {
+    AsyncIo *io = arg;
+    pthread_mutex_lock(&io->sync->mu);
+    for (;;) {
+        while (io->reads.head == io->reads.tail && !io->stop) pthread_cond_wait(&io->sync->cv, &io->sync->mu);
+        if (io->reads.head == io->reads.tail) break;
+        BlockJob *job = io->reads.ring[io->reads.head++ % io->reads.cap];
+        pthread_mutex_unlock(&io->sync->mu);
+        job->n = input_next_block(io->in, io->block_size, job->inbuf, &job->src);
+        pthread_mutex_lock(&io->sync->mu);
+        aio_finish_locked(io, job, JOB_READ);
+    }
+    pthread_mutex_unlock(&io->sync->mu);
+    return NULL;
+}
+
+/* Writer thread: write queued jobs' blocks to out, in order */
+static void *aio_writer(void *arg) {
+    AsyncIo *io = arg;
+    pthread_mutex_lock(&io->sync->mu);
+    for (;;) {
+        while (io->writes.head == io->writes.tail && !io->stop) pthread_cond_wait(&io->sync->cv, &io->sync->mu);
+        if (io->writes.head == io->writes.tail) break;
+        BlockJob *job = io->writes.ring[io->writes.head++ % io->writes.cap];
+        pthread_mutex_unlock(&io->sync->mu);
+        job->io_ok = fwrite(job->out, 1, job->out_size, io->out) == job->out_size;
+        pthread_mutex_lock(&io->sync->mu);
+        aio_finish_locked(io, job, JOB_WRITTEN);
+    }
+    pthread_mutex_unlock(&io->sync->mu);
+    return NULL;
+}
+
+static pthread_t aio_thread(void *(*fn)(void *), AsyncIo *io) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, fn, io) != 0) {
+        fprintf(stderr, "Thread creation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return t;
+}
+
+#ifdef HAVE_IO_URING
+static int uring_enter(int fd, unsigned submit, unsigned wait) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * Queue the part of job's read or write not yet transferred (op is
+ * IORING_OP_READ or IORING_OP_WRITE). job NULL queues the no-op that
+ * tells the reaper to exit.
+ */
+static void uring_submit(AsyncIo *io, BlockJob *job, int op) {
+    pthread_mutex_lock(&io->sq_mu);
+    unsigned tail = *io->sq_tail;
+    unsigned idx = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)(job ? op : IORING_OP_NOP);
+    if (job) {
+        int writing = op == IORING_OP_WRITE;
+        sqe->fd = writing ? io->out_fd : io->in_fd;
+        sqe->addr = (uint64_t)(uintptr_t)((writing ? job->out : job->inbuf) + job->io_done);
+        sqe->len = (uint32_t)(job->io_len - job->io_done);
+        sqe->off = job->io_off + job->io_done;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)job;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (uring_enter(io->ring_fd, 1, 0) < 0 && (errno == EINTR || errno == EAGAIN)) {}
+    pthread_mutex_unlock(&io->sq_mu);
+}
+
+/*
+ * Reaper thread: take completions, resubmit short or interrupted
+ * transfers and finish the rest. An O_DIRECT read the file system or the
+ * block size cannot satisfy drops the flag and is retried buffered.
+ */
+static void *uring_reaper(void *arg) {
+    AsyncIo *io = arg;
+    for (;;) {
+        unsigned head = *io->cq_head;
+        if (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+            uring_enter(io->ring_fd, 0, 1);
+            continue;
+        }
+        struct io_uring_cqe cqe = io->cqes[head & *io->cq_mask];
+        __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+        BlockJob *job = (BlockJob *)(uintptr_t)cqe.user_data;
+        if (!job) break;
+
+        int writing = job->stage == JOB_WRITING;
+        int op = writing ? IORING_OP_WRITE : IORING_OP_READ;
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) { uring_submit(io, job, op); continue; }
+#ifdef O_DIRECT
+        /* reads queued before another one dropped the flag fail too; each gets one retry */
+        if (cqe.res == -EINVAL && !writing && !job->io_retried) {
+            int fl = fcntl(io->in_fd, F_GETFL);
+            if (fl >= 0 && (fl & O_DIRECT)) fcntl(io->in_fd, F_SETFL, fl & ~O_DIRECT);
+            job->io_retried = 1;
+            uring_submit(io, job, op);
+            continue;
+        }
+#endif
+        if (cqe.res > 0) {
+            job->io_done += (size_t)cqe.res;
+            if (job->io_done < job->io_need) { uring_submit(io, job, op); continue; }
+        } else {
+            job->io_ok = 0; /* an error, or the input ended early */
+        }
+        if (!writing) {
+            job->n = job->io_ok ? job->io_need : 0;
+            job->src = job->inbuf;
+            if (!job->io_ok) io->in->read_error = 1;
+        }
+        pthread_mutex_lock(&io->sync->mu);
+        aio_finish_locked(io, job, writing ? JOB_WRITTEN : JOB_READ);
+        pthread_mutex_unlock(&io->sync->mu);
+    }
+    return NULL;
+}
+
+/* Set up a ring for at least entries operations and start its reaper. Returns 1 on success */
+static int uring_setup(AsyncIo *io, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return 0;
+    io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && io->cq_ring_size > io->sq_ring_size) io->sq_ring_size = io->cq_ring_size;
+    io->sq_ring = io->cq_ring = io->sqes = MAP_FAILED;
+    if (p.features & IORING_FEAT_RW_CUR_POS) {
+        io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+        io->cq_ring = single ? io->sq_ring
+                             : mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING);
+        io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+    }
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_size);
+        if (!single && io->cq_ring != MAP_FAILED) munmap(io->cq_ring, io->cq_ring_size);
+        if (io->sq_ring != MAP_FAILED) munmap(io->sq_ring, io->sq_ring_size);
+        close(fd);
+        return 0;
+    }
+    unsigned char *sq = io->sq_ring, *cq = io->cq_ring;
+    io->sq_head = (unsigned *)(sq + p.sq_off.head);
+    io->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    io->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(sq + p.sq_off.array);
+    io->cq_head = (unsigned *)(cq + p.cq_off.head);
+    io->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    io->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    io->ring_fd = fd;
+    pthread_mutex_init(&io->sq_mu, NULL);
+    io->reaper = aio_thread(uring_reaper, io);
+    return 1;
+}
+
+static void uring_teardown(AsyncIo *io) {
+    uring_submit(io, NULL, IORING_OP_NOP);
+    pthread_join(io->reaper, NULL);
+    munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+    pthread_mutex_destroy(&io->sq_mu);
+}
+
+/*
+ * Use io_uring if in is mapped or a regular-file descriptor and out a
+ * regular file written at its current position. Returns 1 if so.
+ */
+static int aio_try_uring(AsyncIo *io, size_t slots) {
+    struct stat st;
+    int out_fd = fileno(io->out);
+    if (input_is_mapped(io->in)) {
+        io->in_fd = -1;
+    } else {
+        off_t pos;
+        if (io->in->fd < 0 || fstat(io->in->fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            (pos = lseek(io->in->fd, 0, SEEK_CUR)) < 0 || pos > st.st_size) return 0;
+        io->in_fd = io->in->fd;
+        io->in_size = (uint64_t)st.st_size;
+        io->read_pos = (uint64_t)pos;
+    }
+    off_t pos;
+    if (out_fd < 0 || fstat(out_fd, &st) != 0 || !S_ISREG(st.st_mode) || (fcntl(out_fd, F_GETFL) & O_APPEND) ||
+        fflush(io->out) != 0 || (pos = ftello(io->out)) < 0) return 0;
+    io->out_fd = out_fd;
+    io->write_pos = (uint64_t)pos;
+    unsigned entries = 1;
+    while (entries < slots + 1) entries <<= 1;
+    return uring_setup(io, entries);
+}
+#endif /* HAVE_IO_URING */
+
+/*
+ * Start I/O for a pipeline of up to slots blocks of block_size bytes from
+ * in to out, queueing jobs for the I/O threads in rings (2 x slots)
+ */
+static void aio_start(AsyncIo *io, BlockJob **rings, InputView *in, FILE *out, size_t block_size, size_t slots,
+                      JobSync *sync) {
+    memset(io, 0, sizeof(*io));
+    io->sync = sync;
+    io->in = in;
+    io->out = out;
+    io->block_size = block_size;
+#ifdef HAVE_IO_URING
+    io->uring = aio_try_uring(io, slots);
+    if (io->uring) return;
+#endif
+    io->reads.cap = io->writes.cap = slots;
+    io->reads.ring = rings;
+    io->writes.ring = rings + slots;
+    io->have_reader = !input_is_mapped(in);
+    if (io->have_reader) io->reader = aio_thread(aio_reader, io);
+    io->have_writer = 1;
+    io->writer = aio_thread(aio_writer, io);
+}
+
+/* Start filling job with the next block of input; job->n is 0 at EOF */
+static void aio_read(AsyncIo *io, BlockJob *job) {
+    if (input_is_mapped(io->in)) {
+        /* nothing to wait for: the block is a slice of the mapping */
+        job->n = input_next_block(io->in, io->block_size, NULL, &job->src);
+        job->stage = JOB_READ;
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (io->uring) {
+        uint64_t left = io->in_size - io->read_pos;
+        size_t need = left < io->block_size ? (size_t)left : io->block_size;
+        if (need == 0) {
+            job->n = 0;
+            job->stage = JOB_READ;
+            return;
+        }
+        job->io_off = io->read_pos;
+        job->io_need = need;
+        job->io_len = (need + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN; /* direct reads: whole sectors */
+        job->io_done = 0;
+        job->io_ok = 1;
+        job->io_retried = 0;
+        io->read_pos += need;
+        pthread_mutex_lock(&io->sync->mu);
+        job->stage = JOB_READING;
+        io->pending++;
+        pthread_mutex_unlock(&io->sync->mu);
+        uring_submit(io, job, IORING_OP_READ);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&io->sync->mu);
+    job->stage = JOB_READING;
+    io->pending++;
+    io->reads.ring[io->reads.tail++ % io->reads.cap] = job;
+    pthread_cond_broadcast(&io->sync->cv);
+    pthread_mutex_unlock(&io->sync->mu);
+}
+
+/* Start writing job's block (job->out_size bytes) after the previous one */
+static void aio_write(AsyncIo *io, BlockJob *job) {
+    job->io_ok = 1;
+#ifdef HAVE_IO_URING
+    if (io->uring) {
+        job->io_off = io->write_pos;
+        job->io_len = job->io_need = job->out_size;
+        job->io_done = 0;
+        io->write_pos += job->out_size;
+        pthread_mutex_lock(&io->sync->mu);
+        job->stage = JOB_WRITING;
+        io->pending++;
+        pthread_mutex_unlock(&io->sync->mu);
+        uring_submit(io, job, IORING_OP_WRITE);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&io->sync->mu);
+    job->stage = JOB_WRITING;
+    io->pending++;
+    io->writes.ring[io->writes.tail++ % io->writes.cap] = job;
+    pthread_cond_broadcast(&io->sync->cv);
+    pthread_mutex_unlock(&io->sync->mu);
+}
+
+/*
+ * Wait for every read and write, stop the I/O threads or ring and leave
+ * out positioned after the last block. Returns 0 if out cannot be
+ * positioned.
+ */
+static int aio_finish(AsyncIo *io) {
+    int ok = 1;
+    pthread_mutex_lock(&io->sync->mu);
+    io->stop = 1;
+    pthread_cond_broadcast(&io->sync->cv);
+    while (io->pending > 0) pthread_cond_wait(&io->sync->cv, &io->sync->mu);
+    pthread_mutex_unlock(&io->sync->mu);
+#ifdef HAVE_IO_URING
+    if (io->uring) {
+        uring_teardown(io);
+        ok = fseeko(io->out, (off_t)io->write_pos, SEEK_SET) == 0;
+    }
+#endif
+    if (io->have_reader) pthread_join(io->reader, NULL);
+    if (io->have_writer) pthread_join(io->writer, NULL);
+    return ok;
+}
+
+/* -----------------------------
+   File I/O: compression & decompression
+   ----------------------------- */
+
+static void plan_block_task(void *arg) {
+    BlockJob *job = arg;
+    plan_block(job->src, job->n, job->opt, job->dict, job->pairs, &job->plan, &job->stats);
+    set_job_stage(job, JOB_PLANNED);
+}
+
+static void encode_block_task(void *arg) {
+    BlockJob *job = arg;
+    job->out_size = encode_block(job->src, job->n, job->opt, job->out, &job->plan, &job->choice, job->dict,
+                                 &job->stats);
+    set_job_stage(job, JOB_ENCODED);
+}
+
+/*
+ * Compress everything left in the input view to out with ctx's options,
+ * under a file header with the given FEATURE_* flags. The same block coder
+ * as huf_compress. Returns 1 on success, 0 otherwise.
+ */
+static int compress_view(HufCtx *ctx, InputView *in, FILE *out, uint32_t features) {
+    const HufOptions *opt = &ctx->opt;
+    unsigned char header[FILE_HEADER_MAX];
+    FrameInfo f;
+    stats_reset(ctx);
+    size_t header_size = put_file_header(header, (uint32_t)opt->block_size, features);
+    parse_file_header(header, header_size, &f);
+    int ok = fwrite(header, 1, header_size, out) == header_size;
+
+    /*
+     * A pipeline over a ring of block slots: reads run ahead into free
+     * slots and writes trail behind (AsyncIo), while the pool plans and
+     * encodes. In between, each block's coding is chosen here in stream
+     * order, since a repeat block depends on the table sent before it; so
+     * output is still identical for any thread count. One thread gets
+     * three slots, so reading block N + 1 and writing block N - 1 overlap
+     * encoding block N; more threads get two slots each. Memory stays
+     * fixed whatever the input size.
+     */
+    int threads = opt->threads > 0 ? opt->threads : cpu_count();
+    Pipeline *pipe = pipeline_acquire(ctx, threads, opt->block_size);
+    size_t inflight = pipe->slots;
+    BlockJob *jobs = pipe->jobs;
+    JobSync sync;
+    pthread_mutex_init(&sync.mu, NULL);
+    pthread_cond_init(&sync.cv, NULL);
+    for (size_t i = 0; i < inflight; ++i) {
+        jobs[i].opt = opt;
+        jobs[i].dict = ctx->dict;
+        jobs[i].sync = &sync;
+    }
+    ThreadPool *pool = pipe->pool;
+    AsyncIo io_state, *io = &io_state;
+    aio_start(io, pipe->rings, in, out, opt->block_size, inflight, &sync);
+
+    /* blocks [done, write) are being written, [write, decide) encoded, [decide, plan) planned, [plan, read) read */
+    uint64_t total = 0, next_read = 0, next_plan = 0, next_decide = 0, next_write = 0, next_done = 0;
+    PrevTable prev;
+    prev.valid = 0;
+    uint64_t offset = header_size;
+    uint32_t crc = 0;
+    size_t index_cap = 16384, index_bytes = 0;
+    unsigned char *index = xmalloc(index_cap);
+    int eof = 0;
+    while (ok) {
+        while (!eof && next_read - next_done < inflight) aio_read(io, &jobs[next_read++ % inflight]);
+        if (eof && next_done == next_plan) break;
+
+        /* take the oldest step that is ready, so writes and reads never wait behind coding */
+        enum { STEP_WRITTEN, STEP_WRITE, STEP_DECIDE, STEP_PLAN } step;
+        BlockJob *job;
+        pthread_mutex_lock(&sync.mu);
+        for (;;) {
+            job = &jobs[next_done % inflight];
+            if (next_done < next_write && job->stage == JOB_WRITTEN) { step = STEP_WRITTEN; break; }
+            job = &jobs[next_write % inflight];
+            if (next_write < next_decide && job->stage == JOB_ENCODED) { step = STEP_WRITE; break; }
+            job = &jobs[next_decide % inflight];
+            if (next_decide < next_plan && job->stage == JOB_PLANNED) { step = STEP_DECIDE; break; }
+            job = &jobs[next_plan % inflight];
+            if (!eof && next_plan < next_read && job->stage == JOB_READ) { step = STEP_PLAN; break; }
+            pthread_cond_wait(&sync.cv, &sync.mu);
+        }
+        pthread_mutex_unlock(&sync.mu);
+
+        if (step == STEP_WRITTEN) {
+            if (!job->io_ok) ok = 0;
+            next_done++;
+        } else if (step == STEP_WRITE) {
+            record_block(&ctx->stats, &job->plan, &job->choice, job->n, ctx->dict);
+            stats_add(&ctx->stats, &job->stats);
+            BlockHeader h;
+            parse_block_header(&f, job->out, job->out_size, &h);
+            crc = crc32c_combine(crc, h.crc, job->n);
+            if (index_cap - index_bytes < INDEX_ENTRY_MAX) {
+                index_cap *= 2;
+                index = xrealloc(index, index_cap);
+            }
+            index_bytes += put_index_entry(index + index_bytes, job->out_size, job->n);
+            offset += job->out_size;
+            next_write++;
+            aio_write(io, job);
+        } else if (step == STEP_DECIDE) {
+            choose_block(&job->plan, job->n, next_decide, opt, ctx->dict, &prev, &job->choice);
+            update_prev_table(&prev, &job->plan, &job->choice, next_decide);
+            next_decide++;
+            if (pool) pool_submit(pool, encode_block_task, job);
+            else encode_block_task(job);
+        } else if (job->n == 0) {
+            /* reads already queued past the end come back empty and are dropped */
+            eof = 1;
+            next_read = next_plan;
+        } else {
+            job->stage = JOB_QUEUED;
+            memset(&job->stats, 0, sizeof(job->stats));
+            total += job->n;
+            next_plan++;
+            if (pool) pool_submit(pool, plan_block_task, job);
+            else plan_block_task(job);
+        }
+    }
+    if (!aio_finish(io)) ok = 0;
+    /* the index is the one buffer that grows with the input */
+    note_memory(ctx, pipe, index_cap);
+    pipeline_release(ctx, pipe);
+    pthread_mutex_destroy(&sync.mu);
+    pthread_cond_destroy(&sync.cv);
+    if (input_error(in)) {
+        fprintf(stderr, "Error: cannot read input\n");
+        free(index);
+        return 0;
+    }
+
+    unsigned char end[END_BLOCK_SIZE];
+    put_end_block(end, total, crc);
+    unsigned char trailer[INDEX_TRAILER_SIZE];
+    put_index_trailer(trailer, index, index_bytes);
+    if (ok && (fwrite(end, 1, END_BLOCK_SIZE, out) != END_BLOCK_SIZE ||
+               fwrite(index, 1, index_bytes, out) != index_bytes ||
+               fwrite(trailer, 1, INDEX_TRAILER_SIZE, out) != INDEX_TRAILER_SIZE)) ok = 0;
+    free(index);
+    ctx->stats.bytes_out = offset + END_BLOCK_SIZE + index_bytes + INDEX_TRAILER_SIZE;
+    if (fflush(out) != 0) ok = 0;
+    if (!ok) fprintf(stderr, "Error writing compressed data\n");
+    return ok;
+}
+
+/* Compress input_path into output_path. Returns 1 on success, 0 otherwise */
+int huf_compress_file(HufCtx *ctx, const char *input_path, const char *output_path) {
+    InputView in;
+    if (!input_open(input_path, ctx->opt.direct_io, &in)) {
+        fprintf(stderr, "Error: cannot open input file '%s'\n", input_path);
+        return 0;
+    }
+    FILE *out = fopen(output_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: cannot open output file '%s'\n", output_path);
+        input_close(&in);
+        return 0;
+    }
+    if (in.fp) setvbuf(in.fp, (char *)ctx->stdio_buf[0], _IOFBF, STDIO_BUF_SIZE);
+    setvbuf(out, (char *)ctx->stdio_buf[1], _IOFBF, STDIO_BUF_SIZE);
+    int ok = compress_view(ctx, &in, out, stream_features(&ctx->opt));
+    if (fclose(out) != 0 && ok) {
+        fprintf(stderr, "Error writing compressed data\n");
+        ok = 0;
+    }
+    input_close(&in);
+    return ok;
+}
+
+/* Compress from in to out, read and written front to back; neither is closed */
+int huf_compress_stream(HufCtx *ctx, FILE *in, FILE *out) {
+    InputView v;
+    memset(&v, 0, sizeof(v));
+    v.fp = in;
+    v.fd = -1;
+    return compress_view(ctx, &v, out, stream_features(&ctx->opt));
+}
+
+/* Read the bytes of one varint from in into dst. Returns how many, 0 on EOF or overlong */
+static size_t read_varint_bytes(FILE *in, unsigned char *dst) {
+    for (size_t i = 0; i < VARINT_MAX; ++i) {
+        int c = fgetc(in);
+        if (c == EOF) return 0;
+        dst[i] = (unsigned char)c;
+        if (!(c & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+/* Decode a block stream after its magic (in header[0..4)). Returns 1 on success */
+static int decompress_blocks(HufCtx *ctx, unsigned char header[FILE_HEADER_MAX], FILE *in, FILE *out) {
+    size_t header_size = 8;
+    FrameInfo f;
+    if (fread(header + 4, 1, 4, in) != 4 ||
+        (header[3] >= 4 && (header_size += read_varint_bytes(in, header + 8)) == 8)) {
+        fprintf(stderr, "Error: cannot read file header\n");
+        return 0;
+    }
+    if (parse_file_header(header, header_size, &f) == 0) {
+        if (header[3] >= 4 && (load_le32(header + 4) & ~FEATURES_KNOWN))
+            fprintf(stderr, "Error: file uses unsupported features (flags 0x%x)\n", load_le32(header + 4));
+        else
+            fprintf(stderr, "Error: invalid file header\n");
+        return 0;
+    }
+    uint32_t block_size = f.block_size;
+
+    if (!ctx_reserve(ctx, block_size)) return 0;
+    size_t payload_cap = block_size + CODE_LENGTHS_MAX;
+    unsigned char *payload = ctx->block;
+    unsigned char *raw = ctx->raw;
+    BlockDecoder d;
+    block_decoder_init(&d, &ctx->table, ctx->context, ctx->dict, &ctx->stats);
+    ctx->stats.bytes_in = f.header_size;
+    uint64_t written = 0;
+    uint32_t crc = 0;
+    int ok = 0;
+
+    for (;; d.block++) {
+        unsigned char hdr[BLOCK_HEADER_MAX];
+        if (fread(hdr, 1, 1, in) != 1) {
+            fprintf(stderr, "Unexpected end of compressed file (decoded %llu bytes)\n",
+                    (unsigned long long)written);
+            break;
+        }
+        if (hdr[0] == BLOCK_END) {
+            unsigned char t[END_BLOCK_SIZE - 1];
+            if (fread(t, 1, f.end_size - 1, in) != f.end_size - 1 || load_le64(t) != written) {
+                fprintf(stderr, "Error: size mismatch at end of stream\n");
+                break;
+            }
+            if ((f.features & FEATURE_STREAM_CRC) && load_le32(t + 8) != crc) {
+                fprintf(stderr, "Error: checksum mismatch over the whole stream\n");
+                break;
+            }
+            ctx->stats.bytes_in += f.end_size;
+            ok = 1;
+            break;
+        }
+        /* the rest of the header: raw size (unless implied), payload size, CRC */
+        size_t len = 1;
+        if (f.version < 4) len = fread(hdr + 1, 1, 4, in) == 4 ? 5 : 0;
+        else if (!(hdr[0] & BLOCK_FULL) && (len += read_varint_bytes(in, hdr + 1)) == 1) len = 0;
+        BlockHeader h;
+        if (len == 0 || fread(hdr + len, 1, 8, in) != 8) {
+            fprintf(stderr, "Unexpected end of compressed file (decoded %llu bytes)\n",
+                    (unsigned long long)written);
+            break;
+        }
+        if (parse_block_header(&f, hdr, len + 8, &h) == 0 || h.payload_size > payload_cap) {
+            fprintf(stderr, "Error: corrupt block header\n");
+            break;
+        }
+        if (fread(payload, 1, h.payload_size, in) != h.payload_size) {
+            fprintf(stderr, "Unexpected end of compressed file (decoded %llu bytes)\n",
+                    (unsigned long long)written);
+            break;
+        }
+        ctx->stats.bytes_in += len + 8 + h.payload_size;
+        if (!decompress_block(&d, h.type, payload, h.payload_size, raw, h.raw_size)) {
+            if (!dict_missing(h.type, payload, h.payload_size, ctx->dict))
+                fprintf(stderr, "Error: corrupt block at byte %llu\n", (unsigned long long)written);
+            break;
+        }
+        if (!block_crc_ok(&d, raw, h.raw_size, h.crc)) {
+            fprintf(stderr, "Error: checksum mismatch in block at byte %llu\n", (unsigned long long)written);
+            break;
+        }
+        if (out && fwrite(raw, 1, h.raw_size, out) != h.raw_size) {
+            fprintf(stderr, "Error writing output\n");
+            break;
+        }
+        crc = crc32c_combine(crc, h.crc, h.raw_size);
+        written += h.raw_size;
+    }
+    return ok;
+}
+
+/*
+ * Decode a legacy frequency-table file whose first 8 bytes are in prefix
+ * (out NULL: just check it), reading and writing through ctx's block
+ * buffers and decode table
+ */
+static int decompress_legacy(HufCtx *ctx, const unsigned char prefix[8], FILE *in, FILE *out) {
+    uint64_t total = 0;
+    uint64_t frequencies[256];
+    memcpy(&total, prefix, 8);
+    if (fread(frequencies, sizeof(uint64_t), 256, in) != 256) {
+        fprintf(stderr, "Error: cannot read frequency table\n");
+        return 0;
+    }
+    /* the legacy writer counted exactly total bytes; reject anything else before building on it */
+    uint64_t sum = 0;
+    int ok = 1;
+    for (int i = 0; i < 256 && ok; ++i) {
+        ok = frequencies[i] <= total - sum;
+        if (ok) sum += frequencies[i];
+    }
+    if (!ok || sum != total) {
+        fprintf(stderr, "Error: frequency table does not match the original size\n");
+        return 0;
+    }
+    HuffmanTree tree;
+    if (build_huffman_tree(frequencies, &tree) < 0) {
+        if (total == 0) return 1;
+        fprintf(stderr, "Error: rebuilt empty Huffman tree\n");
+        return 0;
+    }
+    unsigned char *obuf = ctx->raw;
+    size_t chunk = ctx->block_cap;
+
+    /* special case: only one unique char */
+    if (node_is_leaf(&tree.nodes[tree.root])) {
+        memset(obuf, tree.nodes[tree.root].ch, chunk);
+        /* nothing to check when verifying, however large total claims to be */
+        for (uint64_t left = out ? total : 0; left > 0; ) {
+            size_t n = left < chunk ? (size_t)left : chunk;
+            if (fwrite(obuf, 1, n, out) != n) {
+                fprintf(stderr, "Error writing output\n");
+                return 0;
+            }
+            left -= n;
+        }
+        return 1;
+    }
+
+    /* normal case: decode HUF_TABLE_BITS at a time through the lookup table */
+    DecodeTable *table = &ctx->table;
+    decode_table_build(table, &tree);
+    BitReader br;
+    bitreader_init_file(&br, in, ctx->block, chunk);
+    uint64_t written = 0;
+    while (written < total) {
+        uint64_t left = total - written;
+        size_t want = left < chunk ? (size_t)left : chunk;
+        size_t got = bit_kernels()->decode(table, &br, obuf, want);
+        if (out && fwrite(obuf, 1, got, out) != got) {
+            fprintf(stderr, "Error writing output\n");
+            break;
+        }
+        written += got;
+        if (got < want) {
+            fprintf(stderr, "Unexpected end of compressed file (decoded %llu of %llu)\n",
+                    (unsigned long long)written, (unsigned long long)total);
+            break;
+        }
+    }
+
+    /* the table walks tree, which is gone once this returns */
+    table->tree = NULL;
+    return (written == total);
+}
+
+/*
+ * Decode the rest of in after its first 4 bytes (already read into prefix):
+ * a block stream when they are the magic, else a legacy file. With out
+ * NULL everything is decoded and checked but nothing is written.
+ */
+static int decompress_after_magic(HufCtx *ctx, unsigned char prefix[FILE_HEADER_MAX], FILE *in, FILE *out) {
+    stats_reset(ctx);
+    if (memcmp(prefix, HUF_MAGIC, 3) == 0 && version_supported(prefix[3]))
+        return decompress_blocks(ctx, prefix, in, out);
+    if (fread(prefix + 4, 1, 4, in) != 4) {
+        fprintf(stderr, "Error: cannot read original size\n");
+        return 0;
+    }
+    return decompress_legacy(ctx, prefix, in, out);
+}
+
+/* Decompress input_path into output_path, or only check it if output_path is NULL */
+static int decompress_path(HufCtx *ctx, const char *input_path, const char *output_path) {
+    FILE *in = fopen(input_path, "rb");
+    if (!in) {
+        fprintf(stderr, "Error: cannot open compressed file '%s'\n", input_path);
+        return 0;
+    }
+    setvbuf(in, (char *)ctx->stdio_buf[0], _IOFBF, STDIO_BUF_SIZE);
+
+    unsigned char prefix[FILE_HEADER_MAX];
+    if (fread(prefix, 1, 4, in) != 4) {
+        fprintf(stderr, "Error: cannot read file header\n");
+        fclose(in); return 0;
+    }
+#ifdef HAVE_MMAP
+    int blocks = (memcmp(prefix, HUF_MAGIC, 3) == 0 && version_supported(prefix[3]));
+    int threads = ctx->opt.threads > 0 ? ctx->opt.threads : cpu_count();
+    stats_reset(ctx);
+    if (blocks && threads > 1) {
+        int r = decompress_parallel(ctx, input_path, output_path, threads);
+        if (r >= 0) { fclose(in); return r; }
+    }
+#endif
+
+    FILE *out = output_path ? fopen(output_path, "wb") : NULL;
+    if (output_path && !out) {
+        fprintf(stderr, "Error: cannot open output file '%s'\n", output_path);
+        fclose(in); return 0;
+    }
+    if (out) setvbuf(out, (char *)ctx->stdio_buf[1], _IOFBF, STDIO_BUF_SIZE);
+
+    int ok = decompress_after_magic(ctx, prefix, in, out);
+    fclose(in);
+    if (out && fclose(out) != 0) ok = 0;
+    return ok;
+}
+
+/* Decompress input_path into output_path. Returns 1 on success, 0 otherwise */
+int huf_decompress_file(HufCtx *ctx, const char *input_path, const char *output_path) {
+    return decompress_path(ctx, input_path, output_path);
+}
+
+/* Decode and check input_path without writing anything */
+int huf_verify_file(HufCtx *ctx, const char *input_path) {
+    return decompress_path(ctx, input_path, NULL);
+}
+
+#ifdef HAVE_MMAP
+/*
+ * A job for decoding blocks of x one at a time in the caller's thread, in
+ * ctx's buffers. Returns 0 if they cannot hold x's blocks
+ */
+static int range_job_init(DecodeJob *job, HufCtx *ctx, const IndexedFile *x) {
+    memset(job, 0, sizeof(*job));
+    if (!ctx_reserve(ctx, x->frame.block_size)) return 0;
+    job->in_fd = x->fd;
+    job->out_fd = -1;
+    job->frame = &x->frame;
+    job->entries = x->entries;
+    job->cap = block_bound(x->frame.block_size) + CODE_LENGTHS_MAX;
+    job->cbuf = ctx->block;
+    job->raw = ctx->raw;
+    job->table = &ctx->table;
+    job->context = ctx->context;
+    job->table_block = UINT64_MAX;
+    job->dict = ctx->dict;
+    return 1;
+}
+
+#endif
+
+#ifdef HAVE_MMAP
+/*
+ * Write uncompressed bytes [offset, end) of x to out: binary-search the
+ * index for the first block that covers offset, then decode only the
+ * blocks up to end. Repeat blocks first load the table they reuse from the
+ * block that carries it. Every block read is CRC-checked; the whole-stream
+ * CRC needs every block and is not. extra is heap the caller holds for it
+ * (an archive directory), for the memory peak.
+ */
+static int decode_range(HufCtx *ctx, const IndexedFile *x, uint64_t offset, uint64_t end, FILE *out,
+                        size_t extra) {
+    uint64_t lo = 0, hi = x->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (x->entries[mid].raw_offset + x->entries[mid].raw_size <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+
+    DecodeJob job;
+    if (!range_job_init(&job, ctx, x)) return 0;
+    int ok = 1;
+    for (uint64_t i = lo; ok && i < x->count && x->entries[i].raw_offset < end; ++i) {
+        const BlockIndexEntry *e = &x->entries[i];
+        job.block = i;
+        ok = decode_indexed_block(&job);
+        size_t from = offset > e->raw_offset ? (size_t)(offset - e->raw_offset) : 0;
+        size_t to = end - e->raw_offset < e->raw_size ? (size_t)(end - e->raw_offset) : e->raw_size;
+        if (ok && fwrite(job.raw + from, 1, to - from, out) != to - from) {
+            fprintf(stderr, "Error writing output\n");
+            ok = 0;
+        }
+        job.stats.bytes_in += e[1].offset - e->offset;
+    }
+    ctx->stats = job.stats;
+    note_memory(ctx, NULL, x->heap + extra);
+    if (fflush(out) != 0) ok = 0;
+    return ok;
+}
+#endif
+
+/* Write uncompressed bytes [offset, offset + length) of input_path to out */
+int huf_decompress_range(HufCtx *ctx, const char *input_path, uint64_t offset, uint64_t length, FILE *out) {
+    stats_reset(ctx);
+#ifdef HAVE_MMAP
+    IndexedFile x;
+    if (!indexed_open(input_path, &x)) {
+        fprintf(stderr, "Error: '%s' is not a compressed file with a block index\n", input_path);
+        return 0;
+    }
+    if (offset > x.total) {
+        fprintf(stderr, "Error: range starts past the end of the data (%llu bytes)\n", (unsigned long long)x.total);
+        indexed_close(&x);
+        return 0;
+    }
+    uint64_t end = length > x.total - offset ? x.total : offset + length;
+    int ok = decode_range(ctx, &x, offset, end, out, 0);
+    indexed_close(&x);
+    return ok;
+#else
+    (void)input_path; (void)offset; (void)length; (void)out;
+    fprintf(stderr, "Error: random access needs pread, which this system lacks\n");
+    return 0;
+#endif
+}
+
+/* Decompress from in to out in one sequential pass; neither is closed */
+int huf_decompress_stream(HufCtx *ctx, FILE *in, FILE *out) {
+    unsigned char prefix[FILE_HEADER_MAX];
+    if (fread(prefix, 1, 4, in) != 4) {
+        fprintf(stderr, "Error: cannot read file header\n");
+        return 0;
+    }
+    int ok = decompress_after_magic(ctx, prefix, in, out);
+    if (fflush(out) != 0) ok = 0;
+    return ok;
+}
+
+/* Decode and check in without writing anything; in is not closed */
+int huf_verify_stream(HufCtx *ctx, FILE *in) {
+    unsigned char prefix[FILE_HEADER_MAX];
+    if (fread(prefix, 1, 4, in) != 4) {
+        fprintf(stderr, "Error: cannot read file header\n");
+        return 0;
+    }
+    return decompress_after_magic(ctx, prefix, in, NULL);
+}
+
+/* -----------------------------
+   Archives (many files, one block stream)
+   ----------------------------- */
+
+/* Name a file is stored under: its path without leading "/", "./" and "../" */
+static const char *member_name(const char *path) {
+    for (;;) {
+        if (path[0] == '/') path++;
+        else if (path[0] == '.' && path[1] == '/') path += 2;
+        else if (path[0] == '.' && path[1] == '.' && path[2] == '/') path += 3;
+        else return path;
+    }
+}
+
+/* 1 if name stays inside the directory it is extracted to: relative, no ".." */
+static int name_safe(const char *name) {
+    if (name[0] == '/') return 0;
+    for (const char *p = name; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p += len;
+        if (*p) p++;
+    }
+    return 1;
+}
+
+/* 1 if both paths name one file (a hard link counts as the same file) */
+static int same_file(const char *a, const char *b) {
+    struct stat sa, sb;
+    return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static char *path_join(const char *dir, const char *name) {
+    size_t a = strlen(dir), b = strlen(name);
+    char *p = xmalloc(a + b + 2);
+    memcpy(p, dir, a);
+    p[a] = '/';
+    memcpy(p + a + 1, name, b + 1);
+    return p;
+}
+
+/* Add a file found by the walk (path is taken over); caller holds sync.mu */
+static void walk_add_file(DirWalk *w, char *path) {
+    if (w->nfiles == w->files_cap) {
+        w->files_cap = w->files_cap ? 2 * w->files_cap : 1024;
+        w->files = xrealloc(w->files, sizeof(ArchiveMember) * w->files_cap);
+    }
+    ArchiveMember *m = &w->files[w->nfiles++];
+    m->path = path;
+    m->name = member_name(path);
+    m->size = 0;
+    m->offset = 0;
+}
+
+#ifdef HAVE_MMAP
+/* Queue a directory for a walker (path is taken over); caller holds sync.mu */
+static void walk_push_dir(DirWalk *w, char *path) {
+    if (w->ndirs == w->dirs_cap) {
+        w->dirs_cap = w->dirs_cap ? 2 * w->dirs_cap : 64;
+        w->dirs = xrealloc(w->dirs, sizeof(char *) * w->dirs_cap);
+    }
+    w->dirs[w->ndirs++] = path;
+    pthread_cond_signal(&w->sync.cv);
+}
+
+/*
+ * 'd' for a directory, 'f' for a regular file, 0 for anything else
+ * (symbolic links inside a tree are not followed). The type readdir
+ * reports saves a stat per entry on most file systems.
+ */
+static int entry_kind(const char *path, const struct dirent *ent) {
+#ifdef DT_DIR
+    if (ent->d_type == DT_DIR) return 'd';
+    if (ent->d_type == DT_REG) return 'f';
+    if (ent->d_type != DT_UNKNOWN) return 0;
+#else
+    (void)ent;
+#endif
+    struct stat st;
+    if (lstat(path, &st) != 0) return 0;
+    return S_ISDIR(st.st_mode) ? 'd' : S_ISREG(st.st_mode) ? 'f' : 0;
+}
+
+/* Read one directory, queueing its subdirectories and recording its files; dir is freed */
+static void walk_dir(DirWalk *w, char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Warning: skipping directory '%s': %s\n", dir, strerror(errno));
+        free(dir);
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        char *path = path_join(dir, ent->d_name);
+        int kind = entry_kind(path, ent);
+        if (kind == 0) { free(path); continue; }
+        pthread_mutex_lock(&w->sync.mu);
+        if (kind == 'd') walk_push_dir(w, path);
+        else walk_add_file(w, path);
+        pthread_mutex_unlock(&w->sync.mu);
+    }
+    closedir(d);
+    free(dir);
+}
+
+static void *walk_worker(void *arg) {
+    DirWalk *w = arg;
+    pthread_mutex_lock(&w->sync.mu);
+    for (;;) {
+        while (w->ndirs == 0 && w->busy > 0) pthread_cond_wait(&w->sync.cv, &w->sync.mu);
+        if (w->ndirs == 0) break;
+        char *dir = w->dirs[--w->ndirs];
+        w->busy++;
+        pthread_mutex_unlock(&w->sync.mu);
+        walk_dir(w, dir);
+        pthread_mutex_lock(&w->sync.mu);
+        w->busy--;
+    }
+    pthread_cond_broadcast(&w->sync.cv);
+    pthread_mutex_unlock(&w->sync.mu);
+    return NULL;
+}
+#endif
+
+static int member_cmp(const void *a, const void *b) {
+    return strcmp(((const ArchiveMember *)a)->name, ((const ArchiveMember *)b)->name);
+}
+
+static void free_members(ArchiveMember *m, size_t n) {
+    for (size_t i = 0; i < n; ++i) free(m[i].path);
+    free(m);
+}
+
+/*
+ * The files named by inputs, with directories walked recursively by up to
+ * threads walkers at once (a tree of small directories is bound by the
+ * latency of each read, so walkers overlap them). The list is sorted by
+ * name, which makes the archive the same for any thread count and keeps
+ * each directory's files, often alike, next to each other. Returns 1 on
+ * success, 0 if an input is missing or not a file or directory, or if
+ * two different files would be stored under one name.
+ */
+static int collect_members(const char *const *inputs, size_t count, int threads,
+                           ArchiveMember **members, size_t *nmembers) {
+    DirWalk w;
+    memset(&w, 0, sizeof(w));
+    pthread_mutex_init(&w.sync.mu, NULL);
+    pthread_cond_init(&w.sync.cv, NULL);
+    int ok = 1;
+    for (size_t i = 0; i < count && ok; ++i) {
+        struct stat st;
+        size_t len = strlen(inputs[i]);
+        while (len > 1 && inputs[i][len - 1] == '/') len--;
+        char *path = xmalloc(len + 1);
+        memcpy(path, inputs[i], len);
+        path[len] = '\0';
+        if (stat(path, &st) != 0) {
+            fprintf(stderr, "Error: cannot open input '%s'\n", path);
+            ok = 0;
+        } else if (S_ISREG(st.st_mode)) {
+            walk_add_file(&w, path);
+            continue;
+        } else if (S_ISDIR(st.st_mode)) {
+#ifdef HAVE_MMAP
+            walk_push_dir(&w, path);
+            continue;
+#else
+            fprintf(stderr, "Error: '%s' is a directory; this system cannot walk them\n", path);
+            ok = 0;
+#endif
+        } else {
+            fprintf(stderr, "Error: '%s' is not a file or directory\n", path);
+            ok = 0;
+        }
+        free(path);
+    }
+#ifdef HAVE_MMAP
+    if (ok && w.ndirs > 0) {
+        int n = threads < 1 ? 1 : threads;
+        pthread_t *walkers = xmalloc(sizeof(pthread_t) * (size_t)n);
+        int started = 0;
+        while (started < n - 1 && pthread_create(&walkers[started], NULL, walk_worker, &w) == 0) started++;
+        walk_worker(&w);
+        for (int i = 0; i < started; ++i) pthread_join(walkers[i], NULL);
+        free(walkers);
+    }
+#else
+    (void)threads;
+#endif
+    for (size_t i = 0; i < w.ndirs; ++i) free(w.dirs[i]);
+    free(w.dirs);
+    pthread_mutex_destroy(&w.sync.mu);
+    pthread_cond_destroy(&w.sync.cv);
+    if (!ok) {
+        free_members(w.files, w.nfiles);
+        return 0;
+    }
+
+    /*
+     * A file named twice (or reached twice) is stored once; two files that
+     * would be stored under one name, or a name that could not be
+     * extracted, fail rather than leave a file out
+     */
+    if (w.nfiles > 0) qsort(w.files, w.nfiles, sizeof(ArchiveMember), member_cmp);
+    size_t n = 0, i = 0;
+    for (; i < w.nfiles && ok; ++i) {
+        const ArchiveMember *m = &w.files[i];
+        if (!name_safe(m->name)) {
+            fprintf(stderr, "Error: '%s' would be stored as '%s', which leaves the extract directory\n",
+                    m->path, m->name);
+            ok = 0;
+        } else if (n > 0 && strcmp(w.files[n - 1].name, m->name) == 0) {
+            if (same_file(w.files[n - 1].path, m->path)) {
+                free(m->path);
+                continue;
+            }
+            fprintf(stderr, "Error: '%s' and '%s' are both stored as '%s'\n", w.files[n - 1].path, m->path,
+                    m->name);
+            ok = 0;
+        }
+        w.files[n++] = *m;
+    }
+    if (!ok) {
+        for (; i < w.nfiles; ++i) free(w.files[i].path);
+        free_members(w.files, n);
+        return 0;
+    }
+    /* never NULL, even when empty: an input view tells archive input by it */
+    *members = w.files ? w.files : xmalloc(sizeof(ArchiveMember));
+    *nmembers = n;
+    return 1;
+}
+
+/* Heap the member list of an archive being made takes, paths included */
+static size_t members_heap(const ArchiveMember *m, size_t n) {
+    size_t bytes = sizeof(ArchiveMember) * (n ? n : 1);
+    for (size_t i = 0; i < n; ++i) bytes += strlen(m[i].path) + 1;
+    return bytes;
+}
+
+/* Append the directory of the members that were read, and its trailer */
+static int put_directory(FILE *out, const ArchiveMember *m, size_t n, HufStats *stats) {
+    size_t cap = DIRECTORY_TRAILER_SIZE;
+    for (size_t i = 0; i < n; ++i) cap += strlen(m[i].name) + VARINT_MAX + VARINT64_MAX;
+    unsigned char *dir = xmalloc(cap);
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (m[i].size == ARCHIVE_SKIPPED) continue;
+        size_t name_len = strlen(m[i].name);
+        len += put_varint(dir + len, (uint32_t)name_len);
+        memcpy(dir + len, m[i].name, name_len);
+        len += name_len;
+        len += put_varint64(dir + len, m[i].size);
+    }
+    store_le64(dir + len, len);
+    store_le32(dir + len + 8, crc32c(dir, len));
+    memcpy(dir + len + 12, HUF_ARCHIVE_MAGIC, 4);
+    size_t total = len + DIRECTORY_TRAILER_SIZE;
+    int ok = fwrite(dir, 1, total, out) == total && fflush(out) == 0;
+    free(dir);
+    stats->bytes_out += total;
+    return ok;
+}
+
+/*
+ * Pack the files and directory trees named by inputs into one archive:
+ * the files are read back to back into a single block stream, so many
+ * small files share each block, its table (or the trained one) and its
+ * header, and the output is opened once. Reads and writes overlap the
+ * coding as in huf_compress_file. A file that cannot be opened is left out
+ * with a warning. Returns 1 on success, 0 otherwise.
+ */
+int huf_archive_create(HufCtx *ctx, const char *const *inputs, size_t count, const char *output_path) {
+    int threads = ctx->opt.threads > 0 ? ctx->opt.threads : cpu_count();
+    ArchiveMember *members;
+    size_t n;
+    if (!collect_members(inputs, count, threads, &members, &n)) return 0;
+    FILE *out = fopen(output_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: cannot open output file '%s'\n", output_path);
+        free_members(members, n);
+        return 0;
+    }
+    setvbuf(out, (char *)ctx->stdio_buf[1], _IOFBF, STDIO_BUF_SIZE);
+    InputView in;
+    memset(&in, 0, sizeof(in));
+    in.fd = -1;
+    in.members = members;
+    in.nmembers = n;
+    int ok = compress_view(ctx, &in, out, stream_features(&ctx->opt) | FEATURE_DIRECTORY);
+    ctx->stats.memory_peak += members_heap(members, n);
+    if (ok && !put_directory(out, members, n, &ctx->stats)) {
+        fprintf(stderr, "Error writing compressed data\n");
+        ok = 0;
+    }
+    if (fclose(out) != 0 && ok) {
+        fprintf(stderr, "Error writing compressed data\n");
+        ok = 0;
+    }
+    input_close(&in);
+    free_members(members, n);
+    return ok;
+}
+
+#ifdef HAVE_MMAP
+/*
+ * Load and check the directory of archive x: its CRC, that names are
+ * sorted and unique, and that the sizes add up to the data. Member paths
+ * and names point into *names, one allocation; *heap is the bytes it
+ * took, the raw directory included. Returns 1 on success.
+ */
+static int read_directory(const IndexedFile *x, ArchiveMember **members, size_t *count, char **names,
+                          size_t *heap) {
+    uint64_t dir_bytes = x->file_size - DIRECTORY_TRAILER_SIZE - x->stream_size;
+    if (dir_bytes > SIZE_MAX / 2) return 0;
+    size_t len = (size_t)dir_bytes;
+    unsigned char *raw = xmalloc(len + DIRECTORY_TRAILER_SIZE);
+    int ok = pread_full(x->fd, raw, len + DIRECTORY_TRAILER_SIZE, x->stream_size) &&
+             crc32c(raw, len) == load_le32(raw + len + 8);
+
+    /* an entry takes at least three bytes: name length, one byte of name, size */
+    size_t cap = len / 3, n = 0, pos = 0, npos = 0;
+    ArchiveMember *m = xmalloc(sizeof(ArchiveMember) * (cap + 1));
+    char *arena = xmalloc(len + cap + 1);
+    uint64_t offset = 0;
+    while (ok && pos < len) {
+        uint32_t name_len;
+        uint64_t size;
+        size_t vlen = get_varint(raw + pos, len - pos, &name_len);
+        if (vlen == 0 || name_len == 0 || name_len >= len - pos - vlen) { ok = 0; break; }
+        pos += vlen;
+        char *name = arena + npos;
+        memcpy(name, raw + pos, name_len);
+        name[name_len] = '\0';
+        pos += name_len;
+        vlen = get_varint64(raw + pos, len - pos, &size);
+        if (vlen == 0 || size > x->total - offset || memchr(raw + pos - name_len, 0, name_len) ||
+            (n > 0 && strcmp(m[n - 1].name, name) >= 0)) { ok = 0; break; }
+        pos += vlen;
+        npos += name_len + 1;
+        m[n].path = name;
+        m[n].name = name;
+        m[n].size = size;
+        m[n].offset = offset;
+        offset += size;
+        n++;
+    }
+    free(raw);
+    if (!ok || offset != x->total) {
+        free(m);
+        free(arena);
+        return 0;
+    }
+    *members = m;
+    *count = n;
+    *names = arena;
+    *heap = len + DIRECTORY_TRAILER_SIZE + sizeof(ArchiveMember) * (cap + 1) + len + cap + 1;
+    return 1;
+}
+
+/* An archive opened through its block index and directory */
+typedef struct {
+    IndexedFile x;
+    ArchiveMember *members;
+    size_t count;
+    char *names;
+    size_t heap;              /* of the directory */
+} OpenArchive;
+
+static int archive_open(const char *path, OpenArchive *a) {
+    if (!indexed_open(path, &a->x)) {
+        fprintf(stderr, "Error: '%s' is not an archive\n", path);
+        return 0;
+    }
+    if (!(a->x.frame.features & FEATURE_DIRECTORY)) {
+        fprintf(stderr, "Error: '%s' is a compressed file, not an archive\n", path);
+        indexed_close(&a->x);
+        return 0;
+    }
+    if (!read_directory(&a->x, &a->members, &a->count, &a->names, &a->heap)) {
+        fprintf(stderr, "Error: corrupt archive directory in '%s'\n", path);
+        indexed_close(&a->x);
+        return 0;
+    }
+    return 1;
+}
+
+static void archive_close(OpenArchive *a) {
+    free(a->members);
+    free(a->names);
+    indexed_close(&a->x);
+}
+
+/*
+ * Create the missing directories on the way to path, past its first skip
+ * bytes (the destination, which exists). Names are sorted, so a
+ * directory's files come together; *done holds the last directory made
+ * and is not made again.
+ */
+static int make_parents(char *path, size_t skip, char **done) {
+    char *slash = strrchr(path + skip, '/');
+    if (!slash) return 1;
+    size_t len = (size_t)(slash - path);
+    if (*done && strlen(*done) == len && memcmp(*done, path, len) == 0) return 1;
+    for (char *p = path + skip; (p = strchr(p, '/')) != NULL; ++p) {
+        *p = '\0';
+        int ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *p = '/';
+        if (!ok) {
+            fprintf(stderr, "Error: cannot create directory '%.*s'\n", (int)(p - path), path);
+            return 0;
+        }
+    }
+    free(*done);
+    *done = xmalloc(len + 1);
+    memcpy(*done, path, len);
+    (*done)[len] = '\0';
+    return 1;
+}
+#endif
+
+/* Write the name and size of every file in archive_path to out, one per line */
+int huf_archive_list(HufCtx *ctx, const char *archive_path, FILE *out) {
+    stats_reset(ctx);
+#ifdef HAVE_MMAP
+    OpenArchive a;
+    if (!archive_open(archive_path, &a)) return 0;
+    for (size_t i = 0; i < a.count; ++i)
+        fprintf(out, "%12llu  %s\n", (unsigned long long)a.members[i].size, a.members[i].name);
+    note_memory(ctx, NULL, a.x.heap + a.heap);
+    archive_close(&a);
+    if (fflush(out) != 0) {
+        fprintf(stderr, "Error writing output\n");
+        return 0;
+    }
+    return 1;
+#else
+    (void)archive_path; (void)out;
+    fprintf(stderr, "Error: reading archives needs pread, which this system lacks\n");
+    return 0;
+#endif
+}
+
+/*
+ * Write the file stored as name to out: a binary search of the directory,
+ * then a range decode of just the blocks that hold it
+ */
+int huf_archive_extract(HufCtx *ctx, const char *archive_path, const char *name, FILE *out) {
+    stats_reset(ctx);
+#ifdef HAVE_MMAP
+    OpenArchive a;
+    if (!archive_open(archive_path, &a)) return 0;
+    const char *key = member_name(name);
+    size_t lo = 0, hi = a.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(a.members[mid].name, key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    int ok = lo < a.count && strcmp(a.members[lo].name, key) == 0;
+    if (!ok) fprintf(stderr, "Error: '%s' is not in the archive\n", name);
+    else ok = decode_range(ctx, &a.x, a.members[lo].offset, a.members[lo].offset + a.members[lo].size, out,
+                           a.heap);
+    archive_close(&a);
+    return ok;
+#else
+    (void)archive_path; (void)name; (void)out;
+    fprintf(stderr, "Error: reading archives needs pread, which this system lacks\n");
+    return 0;
+#endif
+}
+
+/*
+ * Recreate every file of archive_path under dest_dir, decoding the blocks
+ * once, in order, and cutting them into files as they go; the whole-stream
+ * CRC is checked too. Names that would land outside dest_dir are skipped
+ * with a warning. On failure the file being written is removed; the ones
+ * before it stay.
+ */
+int huf_archive_extract_all(HufCtx *ctx, const char *archive_path, const char *dest_dir) {
+    stats_reset(ctx);
+#ifdef HAVE_MMAP
+    OpenArchive a;
+    if (!archive_open(archive_path, &a)) return 0;
+    const IndexedFile *x = &a.x;
+    DecodeJob job;
+    if (!range_job_init(&job, ctx, x)) {
+        archive_close(&a);
+        return 0;
+    }
+    size_t skip = strlen(dest_dir) + 1;
+    char *done = NULL;
+    uint64_t block = 0;
+    size_t avail = 0, pos = 0;
+    uint32_t crc = 0;
+    int ok = 1;
+    for (size_t i = 0; ok && i < a.count; ++i) {
+        const ArchiveMember *m = &a.members[i];
+        FILE *f = NULL;
+        char *path = NULL;
+        if (!name_safe(m->name)) {
+            fprintf(stderr, "Warning: skipping '%s': outside the destination\n", m->name);
+        } else {
+            path = path_join(dest_dir, m->name);
+            ok = make_parents(path, skip, &done);
+            if (ok && (f = fopen(path, "wb")) == NULL) {
+                fprintf(stderr, "Error: cannot open output file '%s'\n", path);
+                ok = 0;
+            }
+            if (f) setvbuf(f, (char *)ctx->stdio_buf[1], _IOFBF, STDIO_BUF_SIZE);
+        }
+        uint64_t left = m->size;
+        while (ok && left > 0) {
+            if (pos == avail) {
+                const BlockIndexEntry *e = &x->entries[block];
+                job.block = block++;
+                ok = decode_indexed_block(&job);
+                crc = crc32c_combine(crc, job.crc, e->raw_size);
+                job.stats.bytes_in += e[1].offset - e->offset;
+                avail = e->raw_size;
+                pos = 0;
+                continue;
+            }
+            size_t take = left < avail - pos ? (size_t)left : avail - pos;
+            if (f && fwrite(job.raw + pos, 1, take, f) != take) {
+                fprintf(stderr, "Error writing '%s'\n", path);
+                ok = 0;
+            }
+            pos += take;
+            left -= take;
+        }
+        if (f && fclose(f) != 0 && ok) {
+            fprintf(stderr, "Error writing '%s'\n", path);
+            ok = 0;
+        }
+        /* a file cut short by a bad block or a failed write is not left looking whole */
+        if (f && !ok) remove(path);
+        free(path);
+    }
+    if (ok && (x->frame.features & FEATURE_STREAM_CRC) && crc != x->crc) {
+        fprintf(stderr, "Error: stream checksum mismatch\n");
+        ok = 0;
+    }
+    ctx->stats = job.stats;
+    note_memory(ctx, NULL, x->heap + a.heap);
+    free(done);
+    archive_close(&a);
+    return ok;
+#else
+    (void)archive_path; (void)dest_dir;
+    fprintf(stderr, "Error: reading archives needs pread, which this system lacks\n");
+    return 0;
+#endif
+}
@@ -0,0 +1,232 @@
+/*
+ * huf.h
+ *
+ * Public interface of the Huffman block codec (libhuf).
+ *
+ * In memory:
+ *   HufCtx *ctx = huf_ctx_create(NULL);
+ *   size_t cap = huf_compress_bound(n);
+ *   size_t size = huf_compress(ctx, src, n, dst, cap);
+ *   ...
+ *   size_t got = huf_decompress(ctx, dst, size, out, out_cap);
+ *   huf_ctx_free(ctx);
+ *
+ * A context owns every table and scratch buffer the codec needs, so
+ * repeated calls on one context do not allocate. A context must not be
+ * used by two threads at once; use one per thread instead. Give it a
+ * memory_budget and the file functions' buffers and workers are set up
+ * by huf_ctx_create too (see huf_estimate_memory).
+ *
+ * Build: make (libhuf.a, libhuf.so and the huffman_tool executable)
+ */
+
+#ifndef HUF_H
+#define HUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Block sizes the container accepts (uncompressed bytes per block) */
+#define HUF_MIN_BLOCK_SIZE (1u << 10)
+#define HUF_MAX_BLOCK_SIZE (1u << 24)
+#define HUF_DEFAULT_BLOCK_SIZE (1u << 20)
+
+#define HUF_MAX_CODE_LEN 32          /* longest code the format allows */
+#define HUF_DEFAULT_MAX_CODE_LEN 15  /* encoder default cap */
+#define HUF_MAX_THREADS 256
+#define HUF_MAX_CONTEXT_TABLES 8     /* order-1 tables per block (decode tables stay in L2) */
+#define HUF_MAX_SAMPLE 64            /* approximate mode: at most 1 in this many chunks counted */
+
+/* Returned by the size_t functions below when they fail */
+#define HUF_ERROR ((size_t)-1)
+
+/* Codec options, fixed for the life of a context */
+typedef struct {
+    int max_code_len;  /* cap on code length in bits (raised if too small for the alphabet) */
+    size_t block_size; /* uncompressed bytes per block */
+    int threads;       /* worker threads for the file functions, 0 = one per CPU */
+    int multistream;   /* 1 = split each block into four bitstreams */
+    int direct_io;     /* 1 = read input files with O_DIRECT where supported, bypassing
+                          the page cache (best with block sizes a multiple of 4 KiB) */
+    int context_tables; /* 2..HUF_MAX_CONTEXT_TABLES = also try order-1 coding, each byte
+                           coded with one of this many tables picked by the byte before it;
+                           0 = order-0 only. Streams then need a reader that knows it */
+    int sample;         /* 2..HUF_MAX_SAMPLE = approximate mode: tables come from every
+                           sample-th 16 KiB chunk of a block, with every byte given a code,
+                           so most bytes are read by the encoder only, for a little ratio
+                           (and no repeat blocks); 0 or 1 = exact counts */
+    size_t memory_budget; /* bytes of heap the context may hold, 0 = no limit. With a budget,
+                             huf_ctx_create cuts threads (so in-flight blocks) until the
+                             context fits, or fails if one thread does not, and allocates
+                             it all up front; streams with larger blocks are then refused */
+} HufOptions;
+
+typedef struct HufCtx HufCtx;
+
+void huf_options_init(HufOptions *opt);
+
+/* New context with opt (NULL = defaults). Returns NULL if opt is invalid */
+HufCtx *huf_ctx_create(const HufOptions *opt);
+void huf_ctx_free(HufCtx *ctx);
+
+/*
+ * Most bytes of heap a context made with opt (NULL = defaults) holds: its
+ * block buffers, plus block size x in-flight blocks (two per thread,
+ * three for one) for the file functions, after any cut to fit
+ * opt->memory_budget; over the budget means huf_ctx_create will fail.
+ * Calls add only what grows with the data: the block index (under 40
+ * bytes per block) and an archive's file list. Thread stacks, the
+ * caller's FILE buffers and the page cache behind a memory-mapped input
+ * file (direct_io avoids it) are not counted. Returns 0 if opt is invalid.
+ */
+size_t huf_estimate_memory(const HufOptions *opt);
+
+/* Largest compressed size of src_len input bytes, for any options */
+size_t huf_compress_bound(size_t src_len);
+
+/*
+ * Compress src[0..src_len) into dst. Returns the compressed size, or
+ * HUF_ERROR if it does not fit in dst_cap bytes (huf_compress_bound is
+ * always enough).
+ */
+size_t huf_compress(HufCtx *ctx, const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+/*
+ * Decompress a complete compressed buffer into dst. Returns the number of
+ * bytes written, or HUF_ERROR if src is malformed, fails its checksums or
+ * decodes to more than dst_cap bytes.
+ */
+size_t huf_decompress(HufCtx *ctx, const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+/* Decompressed size recorded in a compressed buffer, or UINT64_MAX if unreadable */
+uint64_t huf_content_size(const void *src, size_t src_len);
+
+/*
+ * File to file, streaming and multi-threaded; compression overlaps its
+ * reads and writes with the coding (io_uring on Linux, I/O threads
+ * elsewhere). Return 1 on success, 0 otherwise.
+ */
+int huf_compress_file(HufCtx *ctx, const char *input_path, const char *output_path);
+int huf_decompress_file(HufCtx *ctx, const char *input_path, const char *output_path);
+/* Same over open streams such as stdin/stdout, one pass, no seeking; neither is closed */
+int huf_compress_stream(HufCtx *ctx, FILE *in, FILE *out);
+int huf_decompress_stream(HufCtx *ctx, FILE *in, FILE *out);
+/*
+ * Decode and check every block CRC32C and the whole-stream CRC32C without
+ * writing the output, at full (multi-threaded, for files) decode speed
+ */
+int huf_verify_file(HufCtx *ctx, const char *input_path);
+int huf_verify_stream(HufCtx *ctx, FILE *in);
+/*
+ * Write uncompressed bytes [offset, offset + length) of input_path (a
+ * compressed file with a block index) to out, decoding only the blocks
+ * that cover them. The range is cut short at the end of the data; an
+ * offset past the end fails. out is flushed, not closed.
+ */
+int huf_decompress_range(HufCtx *ctx, const char *input_path, uint64_t offset, uint64_t length, FILE *out);
+
+/*
+ * Archives of many files: the files and directory trees named by inputs
+ * (walked in parallel) are packed back to back into one block stream, so
+ * small files share blocks and tables, followed by a directory of names
+ * and sizes sorted by name. Only regular files are stored: symbolic links
+ * inside a tree and empty directories are left out. The trained table of ctx, if any, is used as
+ * for any stream. Decompressing an archive as a plain file gives its
+ * files concatenated in name order. Files are stored under their paths
+ * less any leading "/", "./" and "../"; creation fails if two different
+ * files would share a name, or a name keeps a "..". All return 1 on
+ * success, 0 otherwise.
+ */
+int huf_archive_create(HufCtx *ctx, const char *const *inputs, size_t count, const char *output_path);
+/* Size and name of every file, one per line */
+int huf_archive_list(HufCtx *ctx, const char *archive_path, FILE *out);
+/* One file, looked up by name, decoding only the blocks that hold it */
+int huf_archive_extract(HufCtx *ctx, const char *archive_path, const char *name, FILE *out);
+/*
+ * Every file, recreated under dest_dir (which must exist). If one fails
+ * (a corrupt block, a write error), the partly written file is removed
+ * but the files extracted before it remain
+ */
+int huf_archive_extract_all(HufCtx *ctx, const char *archive_path, const char *dest_dir);
+
+/*
+ * Trained tables (dictionaries) for many small inputs that share one byte
+ * distribution: blocks coded with a table carry only its ID. Build one
+ * from the byte counts of a sample corpus (id 0 derives the ID from the
+ * table) and load it into every context that compresses or decompresses
+ * such data. huf_dict_build returns the dictionary size or HUF_ERROR.
+ */
+#define HUF_DICT_MAX_SIZE 524
+size_t huf_dict_build(const uint64_t freq[256], int max_code_len, uint32_t id, void *dst, size_t dst_cap);
+/* Replaces any table already loaded. Returns 1 on success, 0 if dict is malformed */
+int huf_ctx_load_dict(HufCtx *ctx, const void *dict, size_t len);
+/* ID of the loaded table, 0 if none */
+uint32_t huf_ctx_dict_id(const HufCtx *ctx);
+
+/*
+ * Counters for the last compress or decompress call on a context. Stage
+ * times are summed over all threads; they stay 0 when libhuf is built with
+ * HUF_TIMING=0, which compiles the timers out of the hot paths.
+ */
+enum {
+    HUF_STAGE_HISTOGRAM, /* counting bytes */
+    HUF_STAGE_LENGTHS,   /* code lengths (tree build) */
+    HUF_STAGE_CODES,     /* canonical codes, or decode tables */
+    HUF_STAGE_ENCODE,
+    HUF_STAGE_DECODE,
+    HUF_STAGE_CHECKSUM,
+    HUF_STAGE_COUNT
+};
+
+typedef struct {
+    uint64_t bytes_in, bytes_out;
+    uint64_t blocks;
+    uint64_t stored_blocks;
+    uint64_t rle_blocks;
+    uint64_t repeat_blocks;  /* reused the previous block's table */
+    uint64_t dict_blocks;    /* coded with the trained table */
+    uint64_t context_blocks; /* coded order-1, with tables picked by the previous byte */
+    uint64_t table_builds;   /* code tables built, or decode tables rebuilt */
+    uint64_t coded_bytes;    /* bytes in prefix-coded blocks */
+    uint64_t coded_bits;     /* bits their codes took (compression only; estimated in approximate mode) */
+    double entropy_bits;     /* their Shannon entropy, of each byte given the one before it in
+                                order-1 blocks (compression only; likewise) */
+    int max_code_len;        /* longest code used */
+    uint64_t memory_peak;    /* most bytes of heap the context held during the call */
+    uint64_t stage_ns[HUF_STAGE_COUNT];
+} HufStats;
+
+void huf_ctx_stats(const HufCtx *ctx, HufStats *stats);
+/* Short name of a HUF_STAGE_* value, e.g. "histogram" */
+const char *huf_stage_name(int stage);
+/*
+ * Bit-packing kernels chosen for this CPU on first use: "bmi2" on x86-64
+ * with BMI2, else "generic". Setting HUF_KERNELS=generic in the environment
+ * forces the portable ones. Output is the same either way.
+ */
+const char *huf_kernel_name(void);
+
+/* Building blocks, for tools that want to show the codes */
+void huf_count_frequencies(const void *src, size_t n, uint64_t freq[256]);
+/*
+ * Code lengths capped at max_len bits (0 = no cap but the format's
+ * HUF_MAX_CODE_LEN, which is also the most max_len can ask for). Returns
+ * the longest
+ */
+int huf_code_lengths(const uint64_t freq[256], int max_len, unsigned char lengths[256]);
+/*
+ * Canonical code of every byte with a nonzero length (right-aligned, MSB
+ * first). Lengths over HUF_MAX_CODE_LEN are no valid table: every code is then 0
+ */
+void huf_canonical_codes(const unsigned char lengths[256], uint32_t codes[256]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HUF_H */
@@ -0,0 +1,550 @@
+/*
+ * huf_bench.c
+ *
+ * Throughput benchmark for libhuf
+ *
+ * - Runs every input (files, or every file in a directory such as the
+ *   Silesia or Canterbury corpus) plus synthetic data through the codec
+ * - Times histogram, code lengths (tree build), canonical code generation,
+ *   whole compression and decompression separately, best of several runs;
+ *   encode alone comes from the library's own stage timers (HufStats)
+ * - Reports MB/s of input per stage, ratio and peak RSS, as a table and
+ *   optionally as JSON to track regressions between releases, with the
+ *   bit kernels the CPU got (HUF_KERNELS=generic times the portable ones)
+ * - Times the codec's checked decode stage against an unchecked reference
+ *   decoder; -g ratio fails the run (exit status 1) when checked decoding
+ *   falls under ratio times the unchecked speed. The reference decodes the
+ *   bench's own coding of each block, with the huf_code_lengths(freq, -L)
+ *   table and one lookup in 2^L entries per code, while the codec decodes
+ *   what it wrote: 11-bit lookups with a slow path for longer codes, and
+ *   whichever block types it picked (a repeated or order-1 table, four
+ *   streams). So the ratio prices the codec's decoder as a whole against
+ *   the plainest one, not its bounds checks alone
+ *
+ * Build & run:
+ *   make bench CORPUS="silesia canterbury" BENCH_FLAGS="-j bench.json"
+ *   ./huf_bench [-4] [-B block_size] [-L max_len] [-r runs] [-s MiB]
+ *               [-n] [-j out.json|-] [-g ratio] [files or dirs...]
+ *   -n skips the synthetic inputs; "-j -" writes JSON to stdout and the
+ *   table to stderr
+ */
+
+#define _POSIX_C_SOURCE 200809L /* clock_gettime, getrusage, opendir */
+#define _FILE_OFFSET_BITS 64    /* stat on large corpus files, 32-bit systems */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "huf.h"
+
+/* -----------------------------
+   Data structures & typedefs
+   ----------------------------- */
+
+enum {
+    STAGE_HIST, STAGE_TREE, STAGE_CODES, STAGE_COMPRESS, STAGE_DECOMPRESS, STAGE_ENCODE, STAGE_DECODE,
+    STAGE_UNCHECKED, STAGE_COUNT
+};
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "histogram", "tree", "codes", "compress", "decompress", "encode", "decode", "unchecked"
+};
+
+#define REF_MAX_BITS 16 /* longest code the unchecked reference decoder takes */
+
+typedef struct {
+    char name[256];
+    size_t bytes;
+    size_t compressed;
+    double seconds[STAGE_COUNT];  /* best run of each stage */
+    long peak_rss_kb;             /* process peak after this input */
+} BenchResult;
+
+typedef struct {
+    HufOptions opt;
+    int runs;
+    double gate;  /* -g: least decode / unchecked speed ratio, 0 = no gate */
+} BenchConfig;
+
+/* -----------------------------
+   Small helpers
+   ----------------------------- */
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n ? n : 1);
+    if (!p) { fprintf(stderr, "Memory allocation failed\n"); exit(EXIT_FAILURE); }
+    return p;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+    return ru.ru_maxrss; /* kilobytes on Linux */
+}
+
+static int strcmp_ptr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static double mbps(size_t bytes, double seconds) {
+    return seconds > 0 ? (double)bytes / seconds / 1e6 : 0.0;
+}
+
+/* Read a whole file into memory. Returns NULL (with a message) on failure */
+static unsigned char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) { fprintf(stderr, "Error: cannot open %s\n", path); return NULL; }
+    size_t cap = 1 << 20, n = 0;
+    unsigned char *buf = xmalloc(cap);
+    for (;;) {
+        if (n == cap) {
+            cap *= 2;
+            unsigned char *grown = realloc(buf, cap);
+            if (!grown) { fprintf(stderr, "Memory allocation failed\n"); exit(EXIT_FAILURE); }
+            buf = grown;
+        }
+        size_t got = fread(buf + n, 1, cap - n, f);
+        n += got;
+        if (got == 0) break;
+    }
+    int err = ferror(f);
+    fclose(f);
+    if (err) { fprintf(stderr, "Error: cannot read %s\n", path); free(buf); return NULL; }
+    *len = n;
+    return buf;
+}
+
+/* -----------------------------
+   Synthetic inputs
+   ----------------------------- */
+
+static uint64_t rng_next(uint64_t *s) {
+    /* xorshift64*: fixed seed, so every run benchmarks the same bytes */
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * uniform: 64 equally likely symbols (a flat 6-bit code)
+ * skewed:  geometric, symbol k with probability 2^-(k+1) (long codes, length limiting)
+ * single:  one byte repeated
+ * random:  all 256 bytes equally likely (incompressible)
+ */
+static const char *const synthetic_names[] = { "uniform", "skewed", "single", "random" };
+#define SYNTHETIC_COUNT 4
+
+static void make_synthetic(int kind, unsigned char *dst, size_t n) {
+    uint64_t s = 0x9E3779B97F4A7C15ULL + (uint64_t)kind;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t r = rng_next(&s);
+        switch (kind) {
+        case 0: dst[i] = (unsigned char)(r >> 58); break;
+        case 1: {
+            int k = 0;
+            while (k < 63 && (r & 1)) { r >>= 1; k++; }
+            dst[i] = (unsigned char)k;
+            break;
+        }
+        case 2: dst[i] = 'x'; break;
+        default: dst[i] = (unsigned char)(r >> 56); break;
+        }
+    }
+}
+
+/* -----------------------------
+   Unchecked reference decoder
+   ----------------------------- */
+
+/*
+ * The plainest decoder there is, for the throughput gate: one lookup per
+ * code in a table of 2^max_len entries and no bounds or validity checks
+ * at all. It only ever reads the bench's own bitstreams (zero padded), so
+ * it shows what the codec's checked decode stage gives up for safety.
+ */
+typedef struct {
+    uint16_t entry[1 << REF_MAX_BITS]; /* (length << 8) | byte */
+    int bits;                          /* longest code */
+} RefTable;
+
+static uint64_t ref_load_be64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v = (v << 8) | p[i];
+    return v;
+}
+
+static void ref_table_build(RefTable *t, const unsigned char lengths[256], const uint32_t codes[256]) {
+    t->bits = 1;
+    for (int i = 0; i < 256; ++i) if (lengths[i] > t->bits) t->bits = lengths[i];
+    for (int i = 0; i < 256; ++i) {
+        if (!lengths[i]) continue;
+        int shift = t->bits - lengths[i];
+        uint32_t first = codes[i] << shift;
+        for (uint32_t k = 0; k < (1u << shift); ++k) t->entry[first + k] = (uint16_t)(lengths[i] << 8 | i);
+    }
+}
+
+/* MSB-first codes of src[0..n) into dst, which needs n * 2 + 16 bytes (max_len <= 16). Returns bytes */
+static size_t ref_encode(const unsigned char *src, size_t n, const unsigned char lengths[256],
+                         const uint32_t codes[256], unsigned char *dst) {
+    uint64_t acc = 0;
+    int count = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < n; ++i) {
+        acc = acc << lengths[src[i]] | codes[src[i]];
+        count += lengths[src[i]];
+        while (count >= 8) {
+            count -= 8;
+            dst[pos++] = (unsigned char)(acc >> count);
+        }
+    }
+    if (count) dst[pos++] = (unsigned char)(acc << (8 - count));
+    memset(dst + pos, 0, 16);
+    return pos;
+}
+
+static void ref_decode(const RefTable *t, const unsigned char *src, unsigned char *dst, size_t n) {
+    uint64_t acc = 0;
+    int count = 0, per = 56 / t->bits;
+    size_t pos = 0, i = 0;
+    while (i < n) {
+        acc |= ref_load_be64(src + pos) >> count;
+        pos += (size_t)(63 - count) >> 3;
+        count |= 56;
+        for (int j = 0; j < per && i < n; ++j) {
+            uint16_t e = t->entry[acc >> (64 - t->bits)];
+            acc <<= e >> 8;
+            count -= e >> 8;
+            dst[i++] = (unsigned char)e;
+        }
+    }
+}
+
+/*
+ * Seconds the reference takes to decode src coded block by block with the
+ * given lengths, checked against src; -1 if it decodes wrongly
+ */
+static double time_unchecked(const unsigned char *src, size_t n, size_t bs, unsigned char (*lengths)[256],
+                             unsigned char *stream, unsigned char *out, RefTable *t) {
+    double total = 0;
+    uint32_t codes[256];
+    for (size_t off = 0, b = 0; off < n; off += bs, ++b) {
+        size_t len = n - off < bs ? n - off : bs;
+        huf_canonical_codes(lengths[b], codes);
+        ref_table_build(t, lengths[b], codes);
+        ref_encode(src + off, len, lengths[b], codes, stream);
+        double t0 = now_seconds();
+        ref_decode(t, stream, out, len);
+        total += now_seconds() - t0;
+        if (memcmp(out, src + off, len) != 0) return -1;
+    }
+    return total;
+}
+
+/* -----------------------------
+   Benchmark stages
+   ----------------------------- */
+
+/*
+ * Time every stage over src (best of cfg->runs) and check the round trip.
+ * The first three stages run block by block over the codec's block size,
+ * as the compressor does. encode and decode come from the codec's stage
+ * timers; decode is only timed when every block was prefix coded, and
+ * unchecked is the reference decoder over the tables built above.
+ * Returns 1 if the data survived, 0 otherwise.
+ */
+static int bench_buffer(HufCtx *ctx, const BenchConfig *cfg, const unsigned char *src, size_t n,
+                        BenchResult *res) {
+    size_t bs = cfg->opt.block_size;
+    size_t cap = huf_compress_bound(n);
+    unsigned char *comp = xmalloc(cap);
+    unsigned char *back = xmalloc(n);
+    uint64_t (*freq)[256] = xmalloc(sizeof(*freq) * (n / bs + 1));
+    unsigned char (*lengths)[256] = xmalloc(sizeof(*lengths) * (n / bs + 1));
+    uint32_t codes[256];
+    int ref = cfg->opt.max_code_len <= REF_MAX_BITS;
+    unsigned char *stream = ref ? xmalloc(2 * bs + 16) : NULL, *ref_out = ref ? xmalloc(bs) : NULL;
+    RefTable *table = ref ? xmalloc(sizeof(RefTable)) : NULL;
+    int ok = 1;
+
+    res->bytes = n;
+    for (int s = 0; s < STAGE_COUNT; ++s) res->seconds[s] = -1;
+    for (int r = 0; r < cfg->runs && ok; ++r) {
+        double t[STAGE_COUNT];
+        size_t blocks = 0;
+        t[0] = now_seconds();
+        for (size_t off = 0; off < n; off += bs, blocks++) {
+            memset(freq[blocks], 0, sizeof(freq[blocks]));
+            huf_count_frequencies(src + off, n - off < bs ? n - off : bs, freq[blocks]);
+        }
+        t[1] = now_seconds();
+        for (size_t b = 0; b < blocks; ++b) huf_code_lengths(freq[b], cfg->opt.max_code_len, lengths[b]);
+        t[2] = now_seconds();
+        for (size_t b = 0; b < blocks; ++b) huf_canonical_codes(lengths[b], codes);
+        t[3] = now_seconds();
+        size_t size = huf_compress(ctx, src, n, comp, cap);
+        t[4] = now_seconds();
+        HufStats stats;
+        huf_ctx_stats(ctx, &stats);
+        size_t got = (size == HUF_ERROR) ? HUF_ERROR : huf_decompress(ctx, comp, size, back, n);
+        t[5] = now_seconds();
+        HufStats dstats;
+        huf_ctx_stats(ctx, &dstats);
+        t[6] = dstats.coded_bytes == n && n > 0 ? dstats.stage_ns[HUF_STAGE_DECODE] * 1e-9 : -1;
+        t[7] = ref ? time_unchecked(src, n, bs, lengths, stream, ref_out, table) : -1;
+        if (ref && t[7] < 0) {
+            fprintf(stderr, "Error: reference decoder failed for %s\n", res->name);
+            ok = 0;
+            break;
+        }
+
+        if (size == HUF_ERROR || got != n || memcmp(back, src, n) != 0) {
+            fprintf(stderr, "Error: round trip failed for %s\n", res->name);
+            ok = 0;
+            break;
+        }
+        res->compressed = size;
+        for (int s = 0; s < STAGE_COUNT; ++s) {
+            double dt = s == STAGE_ENCODE ? stats.stage_ns[HUF_STAGE_ENCODE] * 1e-9
+                      : s >= STAGE_DECODE ? t[s] : t[s + 1] - t[s];
+            if (dt < 0) continue;
+            if (res->seconds[s] < 0 || dt < res->seconds[s]) res->seconds[s] = dt;
+        }
+    }
+    res->peak_rss_kb = peak_rss_kb();
+    free(comp); free(back); free(freq); free(lengths); free(stream); free(ref_out); free(table);
+    return ok;
+}
+
+/* -----------------------------
+   Reporting
+   ----------------------------- */
+
+static void print_header(FILE *out) {
+    fprintf(out, "kernels: %s\n", huf_kernel_name());
+    fprintf(out, "%-24s %11s %7s", "input", "bytes", "ratio");
+    for (int s = 0; s < STAGE_COUNT; ++s) fprintf(out, " %10s", stage_names[s]);
+    fprintf(out, " %10s\n", "rss KB");
+}
+
+static void print_result(FILE *out, const BenchResult *r) {
+    fprintf(out, "%-24.24s %11zu %6.2f%%", r->name, r->bytes,
+            r->bytes ? 100.0 * (double)r->compressed / (double)r->bytes : 0.0);
+    for (int s = 0; s < STAGE_COUNT; ++s) fprintf(out, " %10.1f", mbps(r->bytes, r->seconds[s]));
+    fprintf(out, " %10ld\n", r->peak_rss_kb);
+}
+
+static void print_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_json(FILE *out, const BenchConfig *cfg, const BenchResult *results, int count) {
+    fprintf(out, "{\n  \"block_size\": %zu,\n  \"max_code_len\": %d,\n  \"multistream\": %d,\n"
+                 "  \"runs\": %d,\n  \"kernels\": \"%s\",\n  \"unit\": \"MB/s\",\n  \"results\": [\n",
+            cfg->opt.block_size, cfg->opt.max_code_len, cfg->opt.multistream, cfg->runs, huf_kernel_name());
+    for (int i = 0; i < count; ++i) {
+        const BenchResult *r = &results[i];
+        fprintf(out, "    {\"name\": ");
+        print_json_string(out, r->name);
+        fprintf(out, ", \"bytes\": %zu, \"compressed\": %zu, \"ratio\": %.6f",
+                r->bytes, r->compressed, r->bytes ? (double)r->compressed / (double)r->bytes : 0.0);
+        for (int s = 0; s < STAGE_COUNT; ++s)
+            fprintf(out, ", \"%s\": %.2f", stage_names[s], mbps(r->bytes, r->seconds[s]));
+        fprintf(out, ", \"peak_rss_kb\": %ld}%s\n", r->peak_rss_kb, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/* -----------------------------
+   Driver
+   ----------------------------- */
+
+typedef struct {
+    BenchResult *items;
+    int count, cap;
+    int failed;
+} ResultList;
+
+static BenchResult *next_result(ResultList *list, const char *name) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? 2 * list->cap : 16;
+        BenchResult *grown = realloc(list->items, sizeof(BenchResult) * list->cap);
+        if (!grown) { fprintf(stderr, "Memory allocation failed\n"); exit(EXIT_FAILURE); }
+        list->items = grown;
+    }
+    BenchResult *r = &list->items[list->count];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    return r;
+}
+
+/* -g: 0 (with a message) if r decoded checked at under cfg->gate times the unchecked speed */
+static int gate_passed(const BenchConfig *cfg, const BenchResult *r) {
+    double checked = mbps(r->bytes, r->seconds[STAGE_DECODE]);
+    double unchecked = mbps(r->bytes, r->seconds[STAGE_UNCHECKED]);
+    if (cfg->gate <= 0 || checked <= 0 || unchecked <= 0 || checked >= cfg->gate * unchecked) return 1;
+    fprintf(stderr, "Error: %s decodes at %.1f MB/s checked, under %.2f x the unchecked %.1f MB/s\n", r->name,
+            checked, cfg->gate, unchecked);
+    return 0;
+}
+
+static void bench_file(HufCtx *ctx, const BenchConfig *cfg, const char *path, const char *name,
+                       ResultList *list, FILE *table) {
+    size_t n;
+    unsigned char *data = read_file(path, &n);
+    if (!data) { list->failed = 1; return; }
+    BenchResult *r = next_result(list, name);
+    if (bench_buffer(ctx, cfg, data, n, r)) {
+        print_result(table, r);
+        list->count++;
+        if (!gate_passed(cfg, r)) list->failed = 1;
+    } else {
+        list->failed = 1;
+    }
+    free(data);
+}
+
+/* A file, or every regular file directly inside a directory (corpus layout) */
+static void bench_path(HufCtx *ctx, const BenchConfig *cfg, const char *path, ResultList *list, FILE *table) {
+    struct stat st;
+    if (stat(path, &st) != 0) { fprintf(stderr, "Error: cannot open %s\n", path); list->failed = 1; return; }
+    if (!S_ISDIR(st.st_mode)) { bench_file(ctx, cfg, path, path, list, table); return; }
+
+    DIR *dir = opendir(path);
+    if (!dir) { fprintf(stderr, "Error: cannot open %s\n", path); list->failed = 1; return; }
+    /* sorted, so reports line up between runs */
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        if (count == cap) {
+            cap = cap ? 2 * cap : 32;
+            char **grown = realloc(names, sizeof(char *) * cap);
+            if (!grown) { fprintf(stderr, "Memory allocation failed\n"); exit(EXIT_FAILURE); }
+            names = grown;
+        }
+        names[count] = xmalloc(strlen(de->d_name) + 1);
+        strcpy(names[count++], de->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), strcmp_ptr);
+
+    for (size_t i = 0; i < count; ++i) {
+        char full[4096], label[256];
+        snprintf(full, sizeof(full), "%s/%s", path, names[i]);
+        snprintf(label, sizeof(label), "%s/%s", path, names[i]);
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) bench_file(ctx, cfg, full, label, list, table);
+        free(names[i]);
+    }
+    free(names);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-4] [-B block_size] [-L max_len] [-r runs] [-s MiB] [-n] [-j out.json|-] [-g ratio]\n"
+            "       [paths...]\n"
+            "  -g ratio  fail if the codec's decode stage runs under ratio x the unchecked column:\n"
+            "            a bare 2^L-entry table decoder over the bench's own coding of each block with\n"
+            "            -L tables, not over the block types and tables the codec chose\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    huf_options_init(&cfg.opt);
+    cfg.runs = 3;
+    cfg.gate = 0;
+    size_t synthetic_mib = 16;
+    int synthetic = 1;
+    const char *json_path = NULL;
+    const char **paths = xmalloc(sizeof(char *) * (size_t)argc);
+    int path_count = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *a = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(a, "-4") == 0) cfg.opt.multistream = 1;
+        else if (strcmp(a, "-n") == 0) synthetic = 0;
+        else if (strcmp(a, "-B") == 0 && val) { cfg.opt.block_size = (size_t)strtoul(val, NULL, 10); i++; }
+        else if (strcmp(a, "-L") == 0 && val) { cfg.opt.max_code_len = atoi(val); i++; }
+        else if (strcmp(a, "-r") == 0 && val) { cfg.runs = atoi(val); i++; }
+        else if (strcmp(a, "-s") == 0 && val) { synthetic_mib = (size_t)strtoul(val, NULL, 10); i++; }
+        else if (strcmp(a, "-j") == 0 && val) { json_path = val; i++; }
+        else if (strcmp(a, "-g") == 0 && val) { cfg.gate = atof(val); i++; }
+        else if (a[0] == '-' && a[1]) { usage(argv[0]); free(paths); return EXIT_FAILURE; }
+        else paths[path_count++] = a;
+    }
+    if (cfg.runs < 1) cfg.runs = 1;
+    if (cfg.gate > 0 && cfg.opt.max_code_len > REF_MAX_BITS) {
+        fprintf(stderr, "Error: -g needs -L %d or less\n", REF_MAX_BITS);
+        free(paths);
+        return EXIT_FAILURE;
+    }
+
+    HufCtx *ctx = huf_ctx_create(&cfg.opt);
+    if (!ctx) {
+        fprintf(stderr, "Error: invalid options\n");
+        free(paths);
+        return EXIT_FAILURE;
+    }
+
+    /* with JSON on stdout, the table goes to stderr */
+    FILE *table = (json_path && strcmp(json_path, "-") == 0) ? stderr : stdout;
+    ResultList list = { NULL, 0, 0, 0 };
+    print_header(table);
+
+    if (synthetic && synthetic_mib > 0) {
+        size_t n = synthetic_mib << 20;
+        unsigned char *data = xmalloc(n);
+        for (int k = 0; k < SYNTHETIC_COUNT; ++k) {
+            make_synthetic(k, data, n);
+            BenchResult *r = next_result(&list, synthetic_names[k]);
+            if (bench_buffer(ctx, &cfg, data, n, r)) {
+                print_result(table, r);
+                list.count++;
+                if (!gate_passed(&cfg, r)) list.failed = 1;
+            } else {
+                list.failed = 1;
+            }
+        }
+        free(data);
+    }
+    for (int i = 0; i < path_count; ++i) bench_path(ctx, &cfg, paths[i], &list, table);
+
+    if (json_path) {
+        FILE *out = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (!out) {
+            fprintf(stderr, "Error: cannot open %s\n", json_path);
+            list.failed = 1;
+        } else {
+            write_json(out, &cfg, list.items, list.count);
+            if (out != stdout && fclose(out) != 0) list.failed = 1;
+        }
+    }
+
+    huf_ctx_free(ctx);
+    free(list.items);
+    free(paths);
+    return list.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
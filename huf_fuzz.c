@@ -0,0 +1,295 @@
+/*
+ * huf_fuzz.c
+ *
+ * libFuzzer target for the libhuf decoders
+ *
+ * - The first input byte picks what the rest is fed to:
+ *     0..63    huf_decompress, as an untrusted compressed buffer
+ *     64..95   the same, with a trained table loaded in the context
+ *     96..127  huf_decompress_stream or huf_verify_stream over fmemopen
+ *     128..159 huf_decompress_file or huf_verify_file on a temporary copy,
+ *              with two threads (so an indexed file decodes in parallel)
+ *     160..191 huf_decompress_range, offset and length from the next bytes
+ *     192..223 huf_archive_list, huf_archive_extract of the first name
+ *              listed, and huf_archive_extract_all into a temporary directory
+ *     224..255 huf_compress then huf_decompress, with the options taken
+ *              from the next byte; the output must equal the input
+ * - Any crash, sanitizer report or round-trip mismatch is a finding
+ * - Decoding contexts have a memory budget for 64 KiB blocks, so streams
+ *   that claim larger blocks are refused instead of growing the buffers
+ * - Output is capped too (a legacy file of one repeated byte may claim
+ *   any size with no data behind it): streams write into a fixed buffer
+ *   and files are limited to FUZZ_FILE_CAP bytes, so writing past either
+ *   fails as an output error
+ *
+ * Build & run (POSIX only: temporary files, fmemopen and nftw):
+ *   make fuzz FUZZ_FLAGS="-max_total_time=600 corpus/"
+ *   (clang with -fsanitize=fuzzer,address,undefined)
+ * corpus/ holds hand-built seeds for inputs the decoder must reject, e.g.
+ * incomplete_code: a block whose code lengths leave part of the code
+ * space unused (one and four streams)
+ *
+ * Without libFuzzer, -DHUF_FUZZ_STANDALONE gives a main that replays the
+ * files named on its command line through the same entry point:
+ *   cc -std=c11 -DHUF_FUZZ_STANDALONE -fsanitize=address,undefined \
+ *      huf_fuzz.c huf.c -o huf_fuzz -pthread -lm
+ */
+
+#define _XOPEN_SOURCE 700 /* fmemopen, open_memstream, mkstemp, mkdtemp, nftw, setrlimit */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "huf.h"
+
+/* Decoded output is capped here, so a header claiming gigabytes fails fast */
+#define FUZZ_OUT_CAP (1u << 20)
+#define FUZZ_FILE_CAP (1u << 26)
+#define FUZZ_BLOCK_SIZE (1u << 16)
+/* Order-1 is only planned for blocks of 32 KiB and up */
+#define FUZZ_CONTEXT_MIN (1u << 15)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* -----------------------------
+   Contexts & temporary files
+   ----------------------------- */
+
+/* A decoding context that refuses blocks over FUZZ_BLOCK_SIZE, with or without a trained table */
+static HufCtx *fuzz_ctx(int threads, int with_dict) {
+    HufOptions opt;
+    huf_options_init(&opt);
+    opt.block_size = FUZZ_BLOCK_SIZE;
+    opt.threads = threads;
+    opt.memory_budget = huf_estimate_memory(&opt);
+    HufCtx *ctx = huf_ctx_create(&opt);
+    if (!ctx) abort();
+    if (with_dict) {
+        /* A skewed table, so dictionary blocks decode with codes of every length */
+        uint64_t freq[256];
+        unsigned char dict[HUF_DICT_MAX_SIZE];
+        for (int i = 0; i < 256; i++) freq[i] = (uint64_t)1 << (i % 24);
+        size_t len = huf_dict_build(freq, HUF_DEFAULT_MAX_CODE_LEN, 1, dict, sizeof dict);
+        if (len == HUF_ERROR || !huf_ctx_load_dict(ctx, dict, len)) abort();
+    }
+    return ctx;
+}
+
+static char in_path[64], out_path[64], dest_dir[64];
+static char sink_buf[FUZZ_OUT_CAP];
+static FILE *sink;
+
+/* Everything under dest_dir, which itself stays */
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag;
+    if (ftw->level > 0) remove(path);
+    return 0;
+}
+
+static void fuzz_cleanup(void) {
+    unlink(in_path);
+    unlink(out_path);
+    nftw(dest_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    rmdir(dest_dir);
+}
+
+/*
+ * Make the temporary files on first use, under $TMPDIR or /tmp, and cap
+ * the size of any file written (with SIGXFSZ ignored, an oversized write
+ * just fails)
+ */
+static void fuzz_files_init(void) {
+    if (sink) {
+        rewind(sink);
+        clearerr(sink);
+        return;
+    }
+    const char *tmp = getenv("TMPDIR");
+    if (!tmp || strlen(tmp) > 32) tmp = "/tmp";
+    snprintf(in_path, sizeof in_path, "%s/huf_fuzz_in_XXXXXX", tmp);
+    snprintf(out_path, sizeof out_path, "%s/huf_fuzz_out_XXXXXX", tmp);
+    snprintf(dest_dir, sizeof dest_dir, "%s/huf_fuzz_dir_XXXXXX", tmp);
+    int fd_in = mkstemp(in_path), fd_out = mkstemp(out_path);
+    if (fd_in < 0 || fd_out < 0 || !mkdtemp(dest_dir)) abort();
+    close(fd_in);
+    close(fd_out);
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_FSIZE, &lim) == 0 && (lim.rlim_max == RLIM_INFINITY || lim.rlim_max > FUZZ_FILE_CAP)) {
+        signal(SIGXFSZ, SIG_IGN);
+        lim.rlim_cur = FUZZ_FILE_CAP;
+        setrlimit(RLIMIT_FSIZE, &lim);
+    }
+    sink = fmemopen(sink_buf, sizeof sink_buf, "wb");
+    if (!sink) abort();
+    atexit(fuzz_cleanup);
+}
+
+/* Replace the temporary input file with src[0..n) */
+static void fuzz_write_input(const uint8_t *src, size_t n) {
+    fuzz_files_init();
+    FILE *f = fopen(in_path, "wb");
+    if (!f || (n && fwrite(src, 1, n, f) != n) || fclose(f) != 0) abort();
+}
+
+/* -----------------------------
+   Decoding untrusted input
+   ----------------------------- */
+
+static unsigned char fuzz_out[FUZZ_OUT_CAP];
+
+static void fuzz_decompress(const uint8_t *src, size_t n, int with_dict) {
+    HufCtx *ctx = fuzz_ctx(1, with_dict);
+    size_t got = huf_decompress(ctx, src, n, fuzz_out, FUZZ_OUT_CAP);
+    if (got != HUF_ERROR && got > FUZZ_OUT_CAP) abort();
+    huf_ctx_free(ctx);
+}
+
+/* The one-pass reader, new-format and legacy, with or without output */
+static void fuzz_stream(const uint8_t *src, size_t n, int verify) {
+    if (n == 0) return; /* fmemopen may refuse an empty buffer */
+    fuzz_files_init();
+    FILE *in = fmemopen((void *)src, n, "rb");
+    if (!in) abort();
+    HufCtx *ctx = fuzz_ctx(1, 0);
+    if (verify) huf_verify_stream(ctx, in);
+    else huf_decompress_stream(ctx, in, sink);
+    huf_ctx_free(ctx);
+    fclose(in);
+}
+
+/* The block index and the parallel decoder, else the streaming path */
+static void fuzz_file(const uint8_t *src, size_t n, int verify) {
+    fuzz_write_input(src, n);
+    HufCtx *ctx = fuzz_ctx(2, 0);
+    if (verify) huf_verify_file(ctx, in_path);
+    else huf_decompress_file(ctx, in_path, out_path);
+    huf_ctx_free(ctx);
+}
+
+static void fuzz_range(const uint8_t *src, size_t n) {
+    if (n < 2) return;
+    uint64_t offset = (uint64_t)src[0] << 9, length = ((uint64_t)src[1] + 1) << 9;
+    fuzz_write_input(src + 2, n - 2);
+    HufCtx *ctx = fuzz_ctx(1, 0);
+    huf_decompress_range(ctx, in_path, offset, length, sink);
+    huf_ctx_free(ctx);
+}
+
+/* The archive directory: listed, searched for its first name, and extracted */
+static void fuzz_archive(const uint8_t *src, size_t n) {
+    fuzz_write_input(src, n);
+    HufCtx *ctx = fuzz_ctx(2, 0);
+    char *listing = NULL;
+    size_t listing_len = 0;
+    FILE *list = open_memstream(&listing, &listing_len);
+    if (!list) abort();
+    int ok = huf_archive_list(ctx, in_path, list);
+    fclose(list);
+    /* lines are "%12llu  name" */
+    if (ok && listing_len > 14) {
+        char *name = listing + 14, *end = strchr(name, '\n');
+        if (end) *end = '\0';
+        huf_archive_extract(ctx, in_path, name, sink);
+        huf_archive_extract_all(ctx, in_path, dest_dir);
+        nftw(dest_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    free(listing);
+    huf_ctx_free(ctx);
+}
+
+/* -----------------------------
+   Round trip
+   ----------------------------- */
+
+static unsigned char fuzz_tile[FUZZ_BLOCK_SIZE];
+
+static void fuzz_round_trip(const uint8_t *src, size_t n, unsigned flags) {
+    HufOptions opt;
+    huf_options_init(&opt);
+    opt.block_size = HUF_MIN_BLOCK_SIZE;
+    opt.threads = 1;
+    opt.max_code_len = 9 + (int)(flags & 7);
+    opt.multistream = (flags >> 3) & 1;
+    opt.sample = (flags >> 5) & 1 ? 2 : 0;
+    if ((flags >> 4) & 1) {
+        /* order-1 needs large blocks, so a short input is repeated up to one */
+        opt.block_size = FUZZ_BLOCK_SIZE;
+        opt.context_tables = 2 + (int)((flags >> 6) % (HUF_MAX_CONTEXT_TABLES - 1));
+        if (n > 0 && n < FUZZ_CONTEXT_MIN) {
+            for (size_t i = 0; i < sizeof fuzz_tile; i += n)
+                memcpy(fuzz_tile + i, src, sizeof fuzz_tile - i < n ? sizeof fuzz_tile - i : n);
+            src = fuzz_tile;
+            n = sizeof fuzz_tile;
+        }
+    }
+
+    HufCtx *ctx = huf_ctx_create(&opt);
+    if (!ctx) abort();
+    size_t cap = huf_compress_bound(n);
+    unsigned char *packed = malloc(cap);
+    unsigned char *back = malloc(n ? n : 1);
+    if (!packed || !back) abort();
+
+    size_t size = huf_compress(ctx, src, n, packed, cap);
+    if (size == HUF_ERROR) abort();
+    size_t got = huf_decompress(ctx, packed, size, back, n);
+    if (got != n || memcmp(back, src, n) != 0) {
+        fprintf(stderr, "Error: round trip of %zu bytes failed (options 0x%02x)\n", n, flags);
+        abort();
+    }
+    free(packed);
+    free(back);
+    huf_ctx_free(ctx);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < 1) return 0;
+    unsigned mode = data[0];
+    if (mode < 64) fuzz_decompress(data + 1, size - 1, 0);
+    else if (mode < 96) fuzz_decompress(data + 1, size - 1, 1);
+    else if (mode < 128) fuzz_stream(data + 1, size - 1, mode & 1);
+    else if (mode < 160) fuzz_file(data + 1, size - 1, mode & 1);
+    else if (mode < 192) fuzz_range(data + 1, size - 1);
+    else if (mode < 224) fuzz_archive(data + 1, size - 1);
+    else if (size >= 2 && size - 2 <= FUZZ_OUT_CAP) fuzz_round_trip(data + 2, size - 2, data[1]);
+    return 0;
+}
+
+/* -----------------------------
+   Standalone replay
+   ----------------------------- */
+
+#ifdef HUF_FUZZ_STANDALONE
+int main(int argc, char **argv) {
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            fprintf(stderr, "Error: cannot open %s\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        size_t cap = 1 << 16, n = 0, got;
+        unsigned char *buf = malloc(cap);
+        if (!buf) abort();
+        while ((got = fread(buf + n, 1, cap - n, f)) > 0) {
+            n += got;
+            if (n == cap) {
+                cap *= 2;
+                buf = realloc(buf, cap);
+                if (!buf) abort();
+            }
+        }
+        fclose(f);
+        LLVMFuzzerTestOneInput(buf, n);
+        free(buf);
+    }
+    return status;
+}
+#endif
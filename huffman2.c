@@ -5,8 +5,9 @@
  *
  * - Read a text (or binary) file, count byte frequencies (0..255)
  * - Build Huffman tree, create codes for each byte
- * - Compress into a file: header (total bytes + 256 freqs) + packed bitstream
- * - Decompress by rebuilding the tree and decoding bits
+ * - Compress into independent blocks, each with its own code-length table,
+ *   canonical-code bitstream (or stored bytes) and CRC32C
+ * - Decompress block by block through a lookup table built from the code lengths
  *
  * Features:
  * - Menu-driven console UI
@@ -14,533 +15,461 @@
  * - Compression ratio display
  * - Safe, modular and commented (student-style)
  *
+ * The codec itself lives in huf.c / huf.h (libhuf); this file is the menu.
+ *
  * Compile:
- *   gcc -std=c11 -O2 huffman_tool.c -o huffman_tool
+ *   make
+ *   (or: gcc -std=c11 -O2 huffman2.c huf.c -o huffman_tool -pthread -lm)
  *
  * Run:
- *   ./huffman_tool
+ *   ./huffman_tool [-T threads] [-4]                     (menu)
+ *   ./huffman_tool -c|-d [-T threads] [-4] [-o out] [in]  (batch)
+ *   ./huffman_tool -t [-T threads] [in...]                (check, no output)
+ *   ./huffman_tool -d --range offset:length [-o out] in   (one byte range)
+ *   ./huffman_tool --train [--id N] -o table samples...   (trained table)
+ *   ./huffman_tool -a -o out.hufa files/dirs...           (archive of many files)
+ *   ./huffman_tool -l out.hufa / -x [-C dir] out.hufa [name]
+ *   -D table with -c/-d (or the menu) codes small blocks with the table
+ *   --stats prints block, table and per-stage timing counters after each run
+ *   --direct reads the input file with O_DIRECT (Linux), so a dump far
+ *   larger than RAM does not flush the page cache
+ *   --order1 with -c/-a codes blocks where it pays with up to 8 tables, each
+ *   byte's picked by the byte before it (smaller text, e.g. logs)
+ *   --fast with -c/-a builds each block's table from 1 in 8 of its 16 KiB
+ *   chunks instead of counting every byte (quicker, slightly larger)
+ *   --memory SIZE (e.g. 24M) caps the codec's heap: it allocates everything
+ *   up front and runs as many threads as fit; --stats shows the peak
+ *   "-" or no name means stdin / stdout, e.g.
+ *   tar cf - dir | ./huffman_tool -c | ssh host './huffman_tool -d | tar xf -'
  *
  * Author: student-friendly style
  */
 
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* files over 2 GiB on 32-bit systems */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
-/* -----------------------------
-   Data structures & typedefs
-   ----------------------------- */
-
-typedef struct HuffmanNode {
-    unsigned char ch;         /* character stored (valid in leaves) */
-    uint64_t freq;            /* frequency / weight */
-    struct HuffmanNode *left;
-    struct HuffmanNode *right;
-} HuffmanNode;
-
-typedef struct {
-    HuffmanNode **data;
-    int size;
-    int capacity;
-} MinHeap;
-
-/* Each code stored as a null-terminated string of '0' and '1' */
-typedef struct {
-    char *bits; /* dynamically allocated string */
-} Code;
-
-/* Bit writer for packing bits into bytes (MSB-first) */
-typedef struct {
-    FILE *fp;
-    unsigned char buffer;
-    int bit_count; /* number of bits currently in buffer (0..7) */
-} BitWriter;
-
-typedef struct {
-    FILE *fp;
-    unsigned char buffer;
-    int bit_count; /* number of bits remaining in buffer (0..7) */
-} BitReader;
+#include "huf.h"
 
 /* -----------------------------
-   Utility helpers
+   Small helpers & UI
    ----------------------------- */
 
-static void *xmalloc(size_t n) {
-    void *p = malloc(n);
-    if (!p) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-    return p;
-}
-
-static char *xstrdup(const char *s) {
-    if (!s) return NULL;
-    char *p = strdup(s);
-    if (!p) {
-        fprintf(stderr, "strdup failed\n");
-        exit(EXIT_FAILURE);
+static void print_codes(const unsigned char lengths[256], const uint32_t codes[256]) {
+    printf("Huffman Codes (byte -> code):\n");
+    for (int i = 0; i < 256; ++i) {
+        if (lengths[i]) {
+            char bits[HUF_MAX_CODE_LEN + 1];
+            for (int b = 0; b < lengths[i]; ++b)
+                bits[b] = ((codes[i] >> (lengths[i] - 1 - b)) & 1) ? '1' : '0';
+            bits[lengths[i]] = '\0';
+            /* print printable representation for common bytes */
+            if (i >= 32 && i <= 126) printf("'%c' (ASCII %d) : %s\n", (char)i, i, bits);
+            else printf("0x%02X (ASCII %d) : %s\n", i, i, bits);
+        }
     }
-    return p;
 }
 
-/* -----------------------------
-   Min-heap (priority queue)
-   ----------------------------- */
-
-static MinHeap *heap_create(int capacity) {
-    MinHeap *h = xmalloc(sizeof(MinHeap));
-    h->data = xmalloc(sizeof(HuffmanNode *) * capacity);
-    h->size = 0;
-    h->capacity = capacity;
-    return h;
-}
-
-static void heap_free(MinHeap *h) {
-    if (!h) return;
-    free(h->data);
-    free(h);
+/* Create sample file if missing (small convenience for demos) */
+static int create_sample_file_if_missing(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f) { fclose(f); return 1; } /* exists */
+    f = fopen(path, "wb");
+    if (!f) return 0;
+    const char *sample = "This is a sample file for Huffman compression demonstration.\n"
+                         "You can replace this with any text file.\n";
+    fwrite(sample, 1, strlen(sample), f);
+    fclose(f);
+    return 1;
 }
 
-static void heap_swap(HuffmanNode **a, HuffmanNode **b) {
-    HuffmanNode *t = *a; *a = *b; *b = t;
+static void show_menu(void) {
+    printf("\n-------- Huffman Compressor --------\n");
+    printf("1. Compress a file\n");
+    printf("2. Decompress a file\n");
+    printf("3. Compress sample file (creates sample if missing)\n");
+    printf("4. Exit\n");
+    printf("Enter choice: ");
 }
 
-static void heapify_up(MinHeap *h, int idx) {
-    while (idx > 0) {
-        int parent = (idx - 1) / 2;
-        if (h->data[parent]->freq <= h->data[idx]->freq) break;
-        heap_swap(&h->data[parent], &h->data[idx]);
-        idx = parent;
-    }
+/* Size of the encoded payload in bits for the given lengths */
+static uint64_t encoded_bits(const uint64_t freq[256], const unsigned char lengths[256]) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 256; ++i) bits += freq[i] * lengths[i];
+    return bits;
 }
 
-static void heapify_down(MinHeap *h, int idx) {
-    for (;;) {
-        int left = 2*idx + 1;
-        int right = 2*idx + 2;
-        int smallest = idx;
-        if (left < h->size && h->data[left]->freq < h->data[smallest]->freq) smallest = left;
-        if (right < h->size && h->data[right]->freq < h->data[smallest]->freq) smallest = right;
-        if (smallest == idx) break;
-        heap_swap(&h->data[idx], &h->data[smallest]);
-        idx = smallest;
+/* Add the byte counts of the rest of in to freq. Returns bytes read */
+static uint64_t count_stream(FILE *in, uint64_t freq[256]) {
+    unsigned char buf[1 << 16];
+    uint64_t total = 0;
+    size_t got;
+    while ((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+        huf_count_frequencies(buf, got, freq);
+        total += got;
     }
+    return total;
 }
 
-static void heap_insert(MinHeap *h, HuffmanNode *node) {
-    if (h->size >= h->capacity) {
-        int newcap = h->capacity * 2;
-        if (newcap < 16) newcap = 16;
-        h->data = realloc(h->data, sizeof(HuffmanNode *) * newcap);
-        if (!h->data) { fprintf(stderr, "Heap realloc failed\n"); exit(EXIT_FAILURE); }
-        h->capacity = newcap;
+/* A helper to build codes just to display them without writing output (for option) */
+static void build_and_show_codes_for_input(const char *input_path) {
+    FILE *in = fopen(input_path, "rb");
+    if (!in) { fprintf(stderr, "Cannot open '%s' to build codes\n", input_path); return; }
+    uint64_t freq[256] = {0};
+    uint64_t total = count_stream(in, freq);
+    fclose(in);
+    if (total == 0) { printf("File is empty.\n"); return; }
+    unsigned char lengths[256];
+    int longest = huf_code_lengths(freq, HUF_DEFAULT_MAX_CODE_LEN, lengths);
+    uint32_t codes[256];
+    huf_canonical_codes(lengths, codes);
+    print_codes(lengths, codes);
+
+    /* what capping the code length costs against unlimited Huffman codes */
+    unsigned char unlimited[256];
+    huf_code_lengths(freq, 0, unlimited);
+    uint64_t best = encoded_bits(freq, unlimited);
+    printf("Longest code: %d bits (limit %d), average %.3f bits/byte\n",
+           longest, HUF_DEFAULT_MAX_CODE_LEN, (double)encoded_bits(freq, lengths) / (double)total);
+    const int limits[] = { 11, 12, 15 };
+    for (int k = 0; k < 3; ++k) {
+        unsigned char capped[256];
+        huf_code_lengths(freq, limits[k], capped);
+        printf("  limit %2d bits: payload +%.4f%% vs unlimited\n", limits[k],
+               100.0 * ((double)encoded_bits(freq, capped) - (double)best) / (double)best);
     }
-    h->data[h->size++] = node;
-    heapify_up(h, h->size - 1);
 }
 
-static HuffmanNode *heap_extract_min(MinHeap *h) {
-    if (h->size == 0) return NULL;
-    HuffmanNode *min = h->data[0];
-    h->data[0] = h->data[--h->size];
-    heapify_down(h, 0);
-    return min;
+/* Counters of the last compress/decompress call on ctx (--stats) */
+static void print_stats(FILE *out, const HufCtx *ctx) {
+    HufStats s;
+    huf_ctx_stats(ctx, &s);
+    fprintf(out, "Bytes in: %llu, bytes out: %llu\n",
+            (unsigned long long)s.bytes_in, (unsigned long long)s.bytes_out);
+    fprintf(out, "Blocks: %llu (stored %llu, RLE %llu, repeated table %llu, trained table %llu, order-1 %llu)\n",
+            (unsigned long long)s.blocks, (unsigned long long)s.stored_blocks,
+            (unsigned long long)s.rle_blocks, (unsigned long long)s.repeat_blocks,
+            (unsigned long long)s.dict_blocks, (unsigned long long)s.context_blocks);
+    fprintf(out, "Tables built: %llu, longest code: %d bits\n", (unsigned long long)s.table_builds, s.max_code_len);
+    fprintf(out, "Peak memory: %llu KiB\n", (unsigned long long)((s.memory_peak + 1023) / 1024));
+    if (s.coded_bytes && s.coded_bits)
+        fprintf(out, "Average code length: %.3f bits/byte (entropy %.3f)\n",
+                (double)s.coded_bits / (double)s.coded_bytes, s.entropy_bits / (double)s.coded_bytes);
+    uint64_t total_ns = 0;
+    for (int i = 0; i < HUF_STAGE_COUNT; ++i) total_ns += s.stage_ns[i];
+    if (total_ns == 0) return; /* built without HUF_TIMING */
+    fprintf(out, "Stage times (ms, all threads):");
+    for (int i = 0; i < HUF_STAGE_COUNT; ++i)
+        if (s.stage_ns[i]) fprintf(out, " %s %.3f", huf_stage_name(i), s.stage_ns[i] / 1e6);
+    fprintf(out, "\n");
 }
 
 /* -----------------------------
-   Huffman tree helpers
+   Batch mode (argv)
    ----------------------------- */
 
-static HuffmanNode *node_create(unsigned char ch, uint64_t freq) {
-    HuffmanNode *n = xmalloc(sizeof(HuffmanNode));
-    n->ch = ch;
-    n->freq = freq;
-    n->left = n->right = NULL;
-    return n;
+static int is_stdio(const char *path) {
+    return path == NULL || strcmp(path, "-") == 0;
 }
 
-static void free_tree(HuffmanNode *root) {
-    if (!root) return;
-    free_tree(root->left);
-    free_tree(root->right);
-    free(root);
-}
-
-/* Build Huffman tree from frequency table (256 entries). Returns root or NULL if empty */
-static HuffmanNode *build_huffman_tree(uint64_t freq[256]) {
-    int unique = 0;
-    for (int i = 0; i < 256; ++i) if (freq[i] > 0) unique++;
-
-    if (unique == 0) return NULL;
-
-    MinHeap *heap = heap_create(unique * 2 + 4);
-    for (int i = 0; i < 256; ++i) {
-        if (freq[i] > 0) {
-            HuffmanNode *leaf = node_create((unsigned char)i, freq[i]);
-            heap_insert(heap, leaf);
-        }
-    }
-
-    /* special case: only one unique char */
-    if (heap->size == 1) {
-        HuffmanNode *single = heap_extract_min(heap);
-        heap_free(heap);
-        return single;
-    }
-
-    while (heap->size > 1) {
-        HuffmanNode *a = heap_extract_min(heap);
-        HuffmanNode *b = heap_extract_min(heap);
-        HuffmanNode *parent = node_create(0, a->freq + b->freq);
-        parent->left = a;
-        parent->right = b;
-        heap_insert(heap, parent);
-    }
-
-    HuffmanNode *root = heap_extract_min(heap);
-    heap_free(heap);
-    return root;
-}
-
-/* -----------------------------
-   Code generation
-   ----------------------------- */
-
-/* Recursively walk tree and fill codes */
-static void generate_codes_recursive(HuffmanNode *node, char *buf, int depth, Code codes[256]) {
-    if (!node) return;
-    if (!node->left && !node->right) {
-        buf[depth] = '\0';
-        codes[node->ch].bits = xstrdup(buf);
-        return;
-    }
-    if (node->left) {
-        buf[depth] = '0';
-        generate_codes_recursive(node->left, buf, depth + 1, codes);
-    }
-    if (node->right) {
-        buf[depth] = '1';
-        generate_codes_recursive(node->right, buf, depth + 1, codes);
+/*
+ * Compress (mode 'c') or decompress ('d') in_path to out_path, either of
+ * which may be stdin/stdout. Named files on both sides get the mmap and
+ * parallel paths; anything else streams front to back.
+ */
+static int run_batch(HufCtx *ctx, int mode, const char *in_path, const char *out_path) {
+    if (!is_stdio(in_path) && !is_stdio(out_path)) {
+        return mode == 'c' ? huf_compress_file(ctx, in_path, out_path)
+                           : huf_decompress_file(ctx, in_path, out_path);
+    }
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    FILE *in = is_stdio(in_path) ? stdin : fopen(in_path, "rb");
+    if (!in) {
+        fprintf(stderr, "Error: cannot open input file '%s'\n", in_path);
+        return 0;
     }
-}
-
-static void generate_codes(HuffmanNode *root, Code codes[256]) {
-    for (int i = 0; i < 256; ++i) codes[i].bits = NULL;
-    if (!root) return;
-
-    /* if single node, give it code "0" */
-    if (!root->left && !root->right) {
-        codes[root->ch].bits = xstrdup("0");
-        return;
+    FILE *out = is_stdio(out_path) ? stdout : fopen(out_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: cannot open output file '%s'\n", out_path);
+        if (in != stdin) fclose(in);
+        return 0;
     }
-    char buf[512];
-    generate_codes_recursive(root, buf, 0, codes);
+    int ok = mode == 'c' ? huf_compress_stream(ctx, in, out) : huf_decompress_stream(ctx, in, out);
+    if (in != stdin) fclose(in);
+    if (out != stdout && fclose(out) != 0) ok = 0;
+    return ok;
 }
 
-static void free_codes(Code codes[256]) {
-    for (int i = 0; i < 256; ++i) {
-        if (codes[i].bits) free(codes[i].bits);
-        codes[i].bits = NULL;
-    }
+/* Parse "offset:length" for --range. Returns 1 on success */
+static int parse_range(const char *arg, uint64_t *offset, uint64_t *length) {
+    char *end;
+    if (arg[0] < '0' || arg[0] > '9') return 0;
+    *offset = strtoull(arg, &end, 0);
+    if (*end != ':' || end[1] < '0' || end[1] > '9') return 0;
+    *length = strtoull(end + 1, &end, 0);
+    return *end == '\0';
 }
 
-/* -----------------------------
-   Bit writing / reading
-   ----------------------------- */
-
-static BitWriter *bitwriter_create(FILE *fp) {
-    BitWriter *bw = xmalloc(sizeof(BitWriter));
-    bw->fp = fp;
-    bw->buffer = 0;
-    bw->bit_count = 0;
-    return bw;
+/* Parse a byte count with an optional K, M or G suffix for --memory. Returns 1 on success */
+static int parse_size(const char *arg, size_t *size) {
+    char *end;
+    if (arg[0] < '0' || arg[0] > '9') return 0;
+    unsigned long long n = strtoull(arg, &end, 0);
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') shift = 10;
+    else if (*end == 'M' || *end == 'm') shift = 20;
+    else if (*end == 'G' || *end == 'g') shift = 30;
+    if (shift) end++;
+    if (*end != '\0' || n > (SIZE_MAX >> shift)) return 0;
+    *size = (size_t)n << shift;
+    return 1;
 }
 
-/* Write single bit (0 or 1) MSB-first */
-static void bitwriter_write_bit(BitWriter *bw, int bit) {
-    bw->buffer |= ((bit & 1) << (7 - bw->bit_count));
-    bw->bit_count++;
-    if (bw->bit_count == 8) {
-        fwrite(&bw->buffer, 1, 1, bw->fp);
-        bw->buffer = 0;
-        bw->bit_count = 0;
+/* Decompress only bytes [offset, offset + length) of in_path (a file) to out_path */
+static int run_range(HufCtx *ctx, const char *in_path, const char *out_path, uint64_t offset, uint64_t length) {
+    if (is_stdio(in_path)) {
+        fprintf(stderr, "Error: --range needs a compressed file, not stdin\n");
+        return 0;
     }
-}
-
-static void bitwriter_write_bits_from_string(BitWriter *bw, const char *s) {
-    for (const char *p = s; *p; ++p) bitwriter_write_bit(bw, (*p == '1'));
-}
-
-static void bitwriter_flush(BitWriter *bw) {
-    if (bw->bit_count > 0) {
-        fwrite(&bw->buffer, 1, 1, bw->fp);
-        bw->buffer = 0;
-        bw->bit_count = 0;
+#ifdef _WIN32
+    if (is_stdio(out_path)) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    FILE *out = is_stdio(out_path) ? stdout : fopen(out_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: cannot open output file '%s'\n", out_path);
+        return 0;
     }
-    free(bw);
-}
-
-static BitReader *bitreader_create(FILE *fp) {
-    BitReader *br = xmalloc(sizeof(BitReader));
-    br->fp = fp;
-    br->buffer = 0;
-    br->bit_count = 0;
-    return br;
+    int ok = huf_decompress_range(ctx, in_path, offset, length, out);
+    if (out != stdout && fclose(out) != 0) ok = 0;
+    return ok;
 }
 
-/* Read one bit: return 1 on success (and set *out), 0 on EOF/error */
-static int bitreader_read_bit(BitReader *br, int *out) {
-    if (br->bit_count == 0) {
-        size_t r = fread(&br->buffer, 1, 1, br->fp);
-        if (r != 1) return 0;
-        br->bit_count = 8;
+/*
+ * Archives: create ('a') one from the inputs, list ('l') one, or extract
+ * ('x') one file of it to out_path (stdout by default) or all of them
+ * under dest_dir
+ */
+static int run_archive(HufCtx *ctx, int mode, const char **inputs, int count, const char *out_path,
+                       const char *dest_dir) {
+    if (mode == 'a') return huf_archive_create(ctx, (const char *const *)inputs, (size_t)count, out_path);
+    if (mode == 'l') return huf_archive_list(ctx, inputs[0], stdout);
+    if (count == 1) return huf_archive_extract_all(ctx, inputs[0], dest_dir ? dest_dir : ".");
+#ifdef _WIN32
+    if (is_stdio(out_path)) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    FILE *out = is_stdio(out_path) ? stdout : fopen(out_path, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: cannot open output file '%s'\n", out_path);
+        return 0;
     }
-    int pos = br->bit_count - 1;
-    int bit = (br->buffer >> (7 - pos)) & 1;
-    br->bit_count--;
-    *out = bit;
-    return 1;
+    int ok = huf_archive_extract(ctx, inputs[0], inputs[1], out);
+    if (out != stdout && fclose(out) != 0) ok = 0;
+    return ok;
 }
 
-static void bitreader_free(BitReader *br) {
-    free(br);
+/*
+ * Decode and check each compressed input (stdin if none) without writing
+ * anything. Returns 1 if all of them are intact.
+ */
+static int run_verify(HufCtx *ctx, const char **inputs, int count, int show_stats) {
+    int ok = 1;
+    for (int i = 0; i < count || (count == 0 && i == 0); ++i) {
+        const char *path = count ? inputs[i] : NULL;
+#ifdef _WIN32
+        if (is_stdio(path)) _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        int good = is_stdio(path) ? huf_verify_stream(ctx, stdin) : huf_verify_file(ctx, path);
+        fprintf(stderr, "%s: %s\n", is_stdio(path) ? "(stdin)" : path, good ? "OK" : "FAILED");
+        if (good && show_stats) print_stats(stderr, ctx);
+        if (!good) ok = 0;
+    }
+    return ok;
 }
 
-/* -----------------------------
-   File I/O: compression & decompression
-   ----------------------------- */
-
 /*
- * Compressed file format:
- * [8 bytes] uint64_t total_original_bytes
- * [256 * 8 bytes] uint64_t frequencies[256]
- * [N bytes] packed compressed bitstream (MSB-first in each byte)
- *
- * Note: uses host byte order. For cross-platform transfers, convert to network byte order.
+ * Train a table on the combined byte counts of the sample files (stdin
+ * if none) and write it to out_path. The table is loaded into ctx to
+ * check it and report its ID.
  */
-
-/* Compress input_path into output_path. Returns 1 on success, 0 otherwise */
-static int compress_file(const char *input_path, const char *output_path) {
-    FILE *in = fopen(input_path, "rb");
-    if (!in) {
-        fprintf(stderr, "Error: cannot open input file '%s'\n", input_path);
-        return 0;
-    }
-
-    uint64_t frequencies[256] = {0};
-    int ch;
+static int run_train(HufCtx *ctx, const char **inputs, int count, uint32_t id, const char *out_path) {
+    uint64_t freq[256] = {0};
     uint64_t total = 0;
-
-    /* First pass: frequency count */
-    while ((ch = fgetc(in)) != EOF) {
-        frequencies[(unsigned char)ch]++;
-        total++;
-    }
-    if (total == 0) {
-        fprintf(stderr, "Input file '%s' is empty. Nothing to compress.\n", input_path);
-        fclose(in);
-        return 0;
+    for (int i = 0; i < count || (count == 0 && i == 0); ++i) {
+        const char *path = count ? inputs[i] : NULL;
+        FILE *in = is_stdio(path) ? stdin : fopen(path, "rb");
+        if (!in) {
+            fprintf(stderr, "Error: cannot open sample file '%s'\n", path);
+            return 0;
+        }
+        total += count_stream(in, freq);
+        if (in != stdin) fclose(in);
     }
 
-    HuffmanNode *root = build_huffman_tree(frequencies);
-    if (!root) {
-        fprintf(stderr, "Failed to build Huffman tree\n");
-        fclose(in);
+    unsigned char dict[HUF_DICT_MAX_SIZE];
+    size_t size = huf_dict_build(freq, HUF_DEFAULT_MAX_CODE_LEN, id, dict, sizeof(dict));
+    if (size == HUF_ERROR || !huf_ctx_load_dict(ctx, dict, size)) {
+        fprintf(stderr, "Error: cannot build trained table\n");
         return 0;
     }
-
-    Code codes[256];
-    generate_codes(root, codes);
-
-    /* Open output and write header */
-    FILE *out = fopen(output_path, "wb");
+    FILE *out = is_stdio(out_path) ? stdout : fopen(out_path, "wb");
     if (!out) {
-        fprintf(stderr, "Error: cannot open output file '%s'\n", output_path);
-        free_tree(root); free_codes(codes); fclose(in);
+        fprintf(stderr, "Error: cannot open output file '%s'\n", out_path);
         return 0;
     }
+    int ok = fwrite(dict, 1, size, out) == size;
+    if (out != stdout) { if (fclose(out) != 0) ok = 0; }
+    else if (fflush(out) != 0) ok = 0;
+    if (!ok) fprintf(stderr, "Error writing trained table\n");
+    else fprintf(stderr, "Trained table %u from %llu sample bytes (%zu bytes)\n",
+                 huf_ctx_dict_id(ctx), (unsigned long long)total, size);
+    return ok;
+}
 
-    /* header */
-    if (fwrite(&total, sizeof(uint64_t), 1, out) != 1) {
-        fprintf(stderr, "Error writing header\n");
-        fclose(in); fclose(out); free_tree(root); free_codes(codes);
+/* Load a trained table file into ctx */
+static int load_dictionary(HufCtx *ctx, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Error: cannot open trained table '%s'\n", path);
         return 0;
     }
-    if (fwrite(frequencies, sizeof(uint64_t), 256, out) != 256) {
-        fprintf(stderr, "Error writing frequency table\n");
-        fclose(in); fclose(out); free_tree(root); free_codes(codes);
+    unsigned char buf[HUF_DICT_MAX_SIZE + 1];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (!huf_ctx_load_dict(ctx, buf, n)) {
+        fprintf(stderr, "Error: '%s' is not a valid trained table\n", path);
         return 0;
     }
-
-    /* Second pass: encode */
-    rewind(in);
-    BitWriter *bw = bitwriter_create(out);
-    while ((ch = fgetc(in)) != EOF) {
-        unsigned char uc = (unsigned char)ch;
-        const char *bits = codes[uc].bits;
-        if (!bits) { /* shouldn't happen */
-            fprintf(stderr, "No code for byte %u\n", uc);
-            bitwriter_flush(bw); fclose(in); fclose(out);
-            free_tree(root); free_codes(codes);
-            return 0;
-        }
-        bitwriter_write_bits_from_string(bw, bits);
-    }
-    bitwriter_flush(bw);
-
-    /* show compression ratio (get sizes) */
-    fflush(out);
-    fclose(in);
-    fclose(out);
-
-    /* clean up */
-    free_tree(root);
-    free_codes(codes);
     return 1;
 }
 
-/* Decompress input_path into output_path. Returns 1 on success, 0 otherwise */
-static int decompress_file(const char *input_path, const char *output_path) {
-    FILE *in = fopen(input_path, "rb");
-    if (!in) {
-        fprintf(stderr, "Error: cannot open compressed file '%s'\n", input_path);
-        return 0;
-    }
-
-    uint64_t total = 0;
-    uint64_t frequencies[256];
-
-    if (fread(&total, sizeof(uint64_t), 1, in) != 1) {
-        fprintf(stderr, "Error: cannot read original size\n");
-        fclose(in); return 0;
-    }
-    if (fread(frequencies, sizeof(uint64_t), 256, in) != 256) {
-        fprintf(stderr, "Error: cannot read frequency table\n");
-        fclose(in); return 0;
-    }
-
-    HuffmanNode *root = build_huffman_tree(frequencies);
-    if (!root && total > 0) {
-        fprintf(stderr, "Error: rebuilt empty Huffman tree\n");
-        fclose(in); return 0;
-    }
-
-    FILE *out = fopen(output_path, "wb");
-    if (!out) {
-        fprintf(stderr, "Error: cannot open output file '%s'\n", output_path);
-        fclose(in); free_tree(root); return 0;
-    }
-
-    /* special case: only one unique char */
-    int unique = 0; unsigned char onlyChar = 0;
-    for (int i = 0; i < 256; ++i) if (frequencies[i] > 0) { unique++; onlyChar = (unsigned char)i; }
-    if (unique == 1) {
-        for (uint64_t i = 0; i < total; ++i) fputc(onlyChar, out);
-        fclose(in); fclose(out); free_tree(root);
-        return 1;
-    }
-
-    /* normal case: read bits and traverse tree */
-    BitReader *br = bitreader_create(in);
-    HuffmanNode *cur = root;
-    uint64_t written = 0;
-    while (written < total) {
-        int bit;
-        if (!bitreader_read_bit(br, &bit)) {
-            fprintf(stderr, "Unexpected end of compressed file (decoded %llu of %llu)\n",
-                    (unsigned long long)written, (unsigned long long)total);
-            break;
-        }
-        if (bit == 0) cur = cur->left;
-        else cur = cur->right;
-
-        if (!cur->left && !cur->right) {
-            fputc(cur->ch, out);
-            written++;
-            cur = root;
-        }
-    }
-
-    bitreader_free(br);
-    fclose(in);
-    fclose(out);
-    free_tree(root);
-    return (written == total);
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-T threads] [-4] [--order1] [-D table] [--stats]                  (interactive menu)\n"
+                    "       %s -c|-d [-T threads] [-4] [--order1] [--fast] [-D table] [--stats] [--direct] [-o out] [in]\n"
+                    "                                               (\"-\" or none = stdin/stdout)\n"
+                    "       any mode: [--memory SIZE]      (heap cap, e.g. 24M; threads are cut to fit)\n"
+                    "       %s -d --range offset:length [-D table] [--stats] [-o out] in     (just those bytes)\n"
+                    "       %s -t [-T threads] [-D table] [--stats] [in...]              (check without output)\n"
+                    "       %s --train [--id N] [-o table] [samples...]\n"
+                    "       %s -a [-T threads] [-4] [--order1] [--fast] [-D table] [--stats] -o archive files/dirs...\n"
+                    "       %s -l archive                                          (list its files)\n"
+                    "       %s -x [-D table] [-C dir] archive      (extract all; -C: into dir, default .)\n"
+                    "       %s -x [-D table] [-o out] archive name                  (extract one file)\n",
+            prog, prog, prog, prog, prog, prog, prog, prog, prog);
 }
 
 /* -----------------------------
-   Small helpers & UI
+   Main program
    ----------------------------- */
 
-static void print_codes(Code codes[256]) {
-    printf("Huffman Codes (byte -> code):\n");
-    for (int i = 0; i < 256; ++i) {
-        if (codes[i].bits) {
-            /* print printable representation for common bytes */
-            if (i >= 32 && i <= 126) printf("'%c' (ASCII %d) : %s\n", (char)i, i, codes[i].bits);
-            else printf("0x%02X (ASCII %d) : %s\n", i, i, codes[i].bits);
+int main(int argc, char **argv) {
+    int threads = 0; /* -T N; 0 = one per CPU */
+    int multistream = 0; /* -4: four bitstreams per block */
+    int direct_io = 0; /* --direct: read inputs around the page cache */
+    int order1 = 0; /* --order1: also try tables picked by the previous byte */
+    int fast = 0; /* --fast: tables from a sample of each block */
+    int mode = 0; /* -c / -d / -t: batch mode, -a / -l / -x: archives, 'r': --train; 0 = menu */
+    const char *out_path = NULL, *dict_path = NULL;
+    uint32_t dict_id = 0; /* --id N; 0 = derived from the table */
+    int show_stats = 0; /* --stats: print the codec counters after each run */
+    const char *range = NULL; /* --range offset:length with -d */
+    const char *dest_dir = NULL; /* -C dir with -x */
+    const char *memory = NULL; /* --memory SIZE: heap budget of the context */
+    size_t memory_budget = 0;
+    uint64_t range_offset = 0, range_length = 0;
+    const char **inputs = malloc(sizeof(char *) * (size_t)argc);
+    int ninputs = 0;
+    if (!inputs) return EXIT_FAILURE;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-4") == 0) {
+            multistream = 1;
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "-t") == 0) {
+            mode = argv[i][1];
+        } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "-x") == 0) {
+            mode = argv[i][1];
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            dest_dir = argv[++i];
+        } else if (strcmp(argv[i], "--train") == 0) {
+            mode = 'r';
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            direct_io = 1;
+        } else if (strcmp(argv[i], "--order1") == 0) {
+            order1 = 1;
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            fast = 1;
+        } else if (strcmp(argv[i], "--range") == 0 && i + 1 < argc) {
+            range = argv[++i];
+        } else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            memory = argv[++i];
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--id") == 0 && i + 1 < argc) {
+            dict_id = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+            dict_path = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            inputs[ninputs++] = argv[i];
+        } else {
+            ninputs = -1;
+            break;
         }
     }
-}
-
-/* Helper to compute file size (0 on error) */
-static uint64_t file_size_bytes(const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return 0;
-    if (fseek(f, 0, SEEK_END) != 0) { fclose(f); return 0; }
-    long pos = ftell(f);
-    fclose(f);
-    if (pos < 0) return 0;
-    return (uint64_t)pos;
-}
-
-/* Create sample file if missing (small convenience for demos) */
-static int create_sample_file_if_missing(const char *path) {
-    FILE *f = fopen(path, "rb");
-    if (f) { fclose(f); return 1; } /* exists */
-    f = fopen(path, "wb");
-    if (!f) return 0;
-    const char *sample = "This is a sample file for Huffman compression demonstration.\n"
-                         "You can replace this with any text file.\n";
-    fwrite(sample, 1, strlen(sample), f);
-    fclose(f);
-    return 1;
-}
+    if (ninputs < 0 || (!mode && (ninputs || out_path)) || ((mode == 'c' || mode == 'd') && ninputs > 1) ||
+        (mode == 't' && out_path) || (mode == 'a' && (!out_path || ninputs == 0)) ||
+        (mode == 'l' && (out_path || ninputs != 1)) || (mode == 'x' && (ninputs < 1 || ninputs > 2)) ||
+        (mode == 'x' && ((ninputs == 1 && out_path) || (ninputs == 2 && dest_dir))) ||
+        (dest_dir && mode != 'x') ||
+        (range && (mode != 'd' || !parse_range(range, &range_offset, &range_length))) ||
+        (memory && !parse_size(memory, &memory_budget))) {
+        usage(argv[0]);
+        free(inputs);
+        return EXIT_FAILURE;
+    }
+    HufOptions opt;
+    huf_options_init(&opt);
+    opt.threads = threads;
+    opt.multistream = multistream;
+    opt.direct_io = direct_io;
+    opt.context_tables = order1 ? HUF_MAX_CONTEXT_TABLES : 0;
+    opt.sample = fast ? 8 : 0;
+    opt.memory_budget = memory_budget;
+    HufCtx *ctx = huf_ctx_create(&opt);
+    if (!ctx || (dict_path && !load_dictionary(ctx, dict_path))) {
+        huf_ctx_free(ctx);
+        free(inputs);
+        return EXIT_FAILURE;
+    }
+    if (mode) {
+        int ok;
+        if (mode == 'r') ok = run_train(ctx, inputs, ninputs, dict_id, out_path);
+        else if (mode == 't') ok = run_verify(ctx, inputs, ninputs, show_stats);
+        else if (mode == 'a' || mode == 'l' || mode == 'x')
+            ok = run_archive(ctx, mode, inputs, ninputs, out_path, dest_dir);
+        else if (range) ok = run_range(ctx, ninputs ? inputs[0] : NULL, out_path, range_offset, range_length);
+        else ok = run_batch(ctx, mode, ninputs ? inputs[0] : NULL, out_path);
+        /* stdout may be carrying the data */
+        if (ok && show_stats && (mode == 'c' || mode == 'd' || mode == 'a' || mode == 'x')) print_stats(stderr, ctx);
+        huf_ctx_free(ctx);
+        free(inputs);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    free(inputs);
 
-static void show_menu(void) {
-    printf("\n-------- Huffman Compressor --------\n");
-    printf("1. Compress a file\n");
-    printf("2. Decompress a file\n");
-    printf("3. Compress sample file (creates sample if missing)\n");
-    printf("4. Exit\n");
-    printf("Enter choice: ");
-}
-
-/* A helper to build codes just to display them without writing output (for option) */
-static void build_and_show_codes_for_input(const char *input_path) {
-    FILE *in = fopen(input_path, "rb");
-    if (!in) { fprintf(stderr, "Cannot open '%s' to build codes\n", input_path); return; }
-    uint64_t freq[256] = {0};
-    int c; uint64_t total = 0;
-    while ((c = fgetc(in)) != EOF) { freq[(unsigned char)c]++; total++; }
-    fclose(in);
-    if (total == 0) { printf("File is empty.\n"); return; }
-    HuffmanNode *root = build_huffman_tree(freq);
-    Code codes[256];
-    generate_codes(root, codes);
-    print_codes(codes);
-    free_codes(codes);
-    free_tree(root);
-}
-
-/* -----------------------------
-   Main program
-   ----------------------------- */
-
-int main(void) {
     for (;;) {
         show_menu();
         int choice;
@@ -557,21 +486,18 @@ int main(void) {
             printf("Enter output compressed file path (e.g. out.huf): ");
             scanf("%511s", outpath);
 
-            uint64_t before = file_size_bytes(inpath);
-            if (before == 0) {
-                printf("Warning: input file not found or empty.\n");
-                continue;
-            }
-
             printf("Compressing '%s' -> '%s' ...\n", inpath, outpath);
-            if (compress_file(inpath, outpath)) {
-                uint64_t after = file_size_bytes(outpath);
-                if (after == 0) after = 1; /* avoid div/0 */
-                double ratio = 100.0 * (1.0 - ((double)after / (double)before));
+            if (huf_compress_file(ctx, inpath, outpath)) {
+                /* sizes come from the codec, which opened the file once */
+                HufStats stats;
+                huf_ctx_stats(ctx, &stats);
+                uint64_t before = stats.bytes_in, after = stats.bytes_out;
+                double ratio = before ? 100.0 * (1.0 - ((double)after / (double)before)) : 0.0;
                 printf("Compression successful.\n");
                 printf("Original size: %llu bytes, Compressed size: %llu bytes\n",
                        (unsigned long long)before, (unsigned long long)after);
                 printf("Space saved: %.2f%%\n", ratio);
+                if (show_stats) print_stats(stdout, ctx);
                 /* Offer to show codes */
                 printf("Would you like to view Huffman codes for this file? (y/n): ");
                 char ans = 'n';
@@ -589,8 +515,9 @@ int main(void) {
             printf("Enter output decompressed file path (e.g. out.txt): ");
             scanf("%511s", outpath);
             printf("Decompressing '%s' -> '%s' ...\n", inpath, outpath);
-            if (decompress_file(inpath, outpath)) {
+            if (huf_decompress_file(ctx, inpath, outpath)) {
                 printf("Decompression successful.\n");
+                if (show_stats) print_stats(stdout, ctx);
             } else {
                 printf("Decompression failed.\n");
             }
@@ -603,10 +530,11 @@ int main(void) {
             }
             printf("Enter compressed output path (e.g. sample.huf): ");
             scanf("%511s", outpath);
-            uint64_t before = file_size_bytes(sample_path);
-            if (compress_file(sample_path, outpath)) {
-                uint64_t after = file_size_bytes(outpath);
-                double ratio = 100.0 * (1.0 - ((double)after / (double)before));
+            if (huf_compress_file(ctx, sample_path, outpath)) {
+                HufStats stats;
+                huf_ctx_stats(ctx, &stats);
+                uint64_t before = stats.bytes_in, after = stats.bytes_out;
+                double ratio = before ? 100.0 * (1.0 - ((double)after / (double)before)) : 0.0;
                 printf("Sample compressed. Original: %llu, Compressed: %llu, Saved: %.2f%%\n",
                        (unsigned long long)before, (unsigned long long)after, ratio);
             } else {
@@ -622,6 +550,7 @@ int main(void) {
         int ch; while ((ch = getchar()) != '\n' && ch != EOF) {}
     }
 
+    huf_ctx_free(ctx);
     return 0;
 }
 